@@ -0,0 +1,1162 @@
+/**************************************************************************/
+/* The parts of Huffman Encode and Huffman Decode that both need. See    */
+/* huffman.h for what each part is for.                                  */
+/**************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+
+/* CRC32C can use the SSE4.2 crc32 instruction here */
+#define crcHardware
+#endif
+
+#include "huffman.h"
+
+/* CRC32C tables for the software path, and whether SSE4.2 is there */
+unsigned int crcTable[8][256];
+int crcHasHardware = 0;
+
+
+/***********************************************************************************
+ * struct QueueNode* insertSorted(struct QueunNode* head, struct QueueNode* newNode)
+ *
+ * The function inserts a node, newNode, into the list/tree hybrid pointed to
+ * by head. It returns the (possibly new) head.
+ */
+struct QueueNode* insertSorted(struct QueueNode* head, struct QueueNode* newNode)
+{
+  struct QueueNode* current = head;
+
+  /* If the list-tree is empty or the new node's frequency is less than
+     the smallest (head) node's frequency, add it there */
+  if(head == NULL || newNode->frequency < head->frequency)
+  {
+    newNode->next = current;
+    return newNode;
+  }
+
+  /* Keep checking that there is another node after current node and next node
+     freq is less than new node's freq, then put the new node at the current
+     position (where either of these are untrue: end of list or
+     new node < existing node) */
+
+  else
+  {
+    /* Comparing unequal frequencies */
+    while(current->next != NULL && current->next->frequency < newNode->frequency)
+      current = current->next;
+
+    if(head->frequency == newNode->frequency && head->data > newNode->data)
+    {
+      newNode->next = current;
+      return newNode;
+    }
+
+    /* Comparing unequal data (ASCII) values with equal frequency values */
+    while(current->next != NULL && current->next->frequency == newNode->frequency &&
+	  current->next->data < newNode->data)
+      current = current->next;
+  }
+  newNode->next = current->next;
+  current->next = newNode;
+  return head;
+}
+
+/**************************************************************************************
+ * struct QueueNode* createNodeLinked(struct QueueNode* head, int data, unsigned long frequency)
+ *
+ * The function creates a new linked list node with character denoted by  data,
+ * and frequency denoted by frequency. It then calls another function to insert it
+ * appropriately in the list pointed to by head. It returns the (possibly new) head.
+ */
+struct QueueNode* createNodeLinked(struct QueueNode* head, int data, unsigned long frequency)
+{
+  /* Make space for new node to insert */
+  struct QueueNode* newNode = malloc(sizeof(struct QueueNode));
+
+  /* Initialize new node's values */
+  newNode->data = data;
+  newNode->frequency = frequency;
+  newNode->left = NULL;
+  newNode->right = NULL;
+  newNode->next = NULL;
+
+  return insertSorted(head, newNode);
+}
+
+/********************************************************************************
+ * struct QueueNode* createTreeNode(struct QueueNode* head)
+ *
+ * This function is called repeatedly to build the tree from existing nodes in
+ * a linked list. It takes the smallest two nodes, combines them with a parent
+ * node, and then reinserts the parent node back into the list/tree hybrid
+ * pointed to by head. It returns the (possibly new) head.
+ */
+struct QueueNode* createNodeTree(struct QueueNode* head)
+{
+  /* Make space for new node to insert (root node of two combined nodes) */
+  struct QueueNode* newNode = malloc(sizeof(struct QueueNode));
+
+  /* Make the ndoe to be the new head */
+  struct QueueNode* newHead;
+
+  /* Initialize values of the new node, change pointers of children */
+  newNode->data = head->next->data;
+  newNode->frequency = (head->frequency) + (head->next->frequency);
+  newNode->left = head;
+  newNode->right = head->next;
+  newNode->next = NULL;
+
+  newHead = head->next->next;
+  head->next->next = NULL;
+  head->next = NULL;
+
+  /* Insert new root with children back into queue */
+  return insertSorted(newHead, newNode);
+
+}
+
+/*******************************************************
+ * struct QueueNode* buildTree(struct QueueNode* head)
+ *
+ * This function is a helper function which calls
+ * createNodeTree until the Huffman tree is fully
+ * built. It creates the tree from the list/tree
+ * hybrid pointed to by head, and returns the root
+ * of the resulting tree.
+ */
+struct QueueNode* buildTree(struct QueueNode* head)
+{
+  while(head->next != NULL)
+    head = createNodeTree(head);
+
+  return head;
+}
+
+/***********************************************
+ * void freeTree(struct QueueNode* head)
+ *
+ * This function frees the malloc-ed memory
+ * used by the nodes which start at head.
+ */
+void freeTree(struct QueueNode* head)
+{
+  if(head != NULL)
+  {
+    freeTree(head->left);
+    freeTree(head->right);
+    free(head);
+  }
+}
+
+/*************************************************************************
+ * unsigned long treeCost(struct QueueNode* root, unsigned long freq[], int depth)
+ *
+ * Returns how many bits coding a stream with the symbol counts in freq
+ * takes with the tree at root, root being depth levels from the top.
+ */
+unsigned long treeCost(struct QueueNode* root, unsigned long freq[], int depth)
+{
+  if(root->left == NULL && root->right == NULL)
+    return freq[root->data] * depth;
+
+  return treeCost(root->left, freq, depth + 1) + treeCost(root->right, freq, depth + 1);
+}
+
+/*********************************************************************
+ * int treeDepth(struct QueueNode* root)
+ *
+ * Returns the depth of the tree at root, which is its longest code.
+ */
+int treeDepth(struct QueueNode* root)
+{
+  int left, right;
+
+  if(root->left == NULL && root->right == NULL) return 0;
+
+  left = treeDepth(root->left);
+  right = treeDepth(root->right);
+  return 1 + (left > right ? left : right);
+}
+
+/*********************************************************************
+ * void limitCodeLengths(unsigned long freq[], int maxLength)
+ *
+ * Flattens the symbol counts in freq, halving them all (used symbols
+ * staying above zero), until the tree built from them has no code
+ * longer than maxLength. The decoder builds its tree from the counts
+ * written to the header, so it follows along. maxLength must be at
+ * least 8, which all-equal counts always meet.
+ */
+void limitCodeLengths(unsigned long freq[], int maxLength)
+{
+  struct QueueNode* head;
+  int c, depth;
+
+  for(;;)
+  {
+    head = NULL;
+    for(c = 0; c < 256; c++)
+      if(freq[c] > 0)
+	head = createNodeLinked(head, c, freq[c]);
+
+    if(head == NULL) return;
+
+    head = buildTree(head);
+    depth = treeDepth(head);
+    freeTree(head);
+
+    if(depth <= maxLength) return;
+
+    for(c = 0; c < 256; c++)
+      if(freq[c] > 0)
+	freq[c] = (freq[c] + 1) / 2;
+  }
+}
+
+/******************************************************************
+ * void buildDecodeTable(struct TableEntry table[], struct QueueNode* root)
+ *
+ * Fills table by walking the tree at root with every pattern of
+ * decodeTableBits bits, lowest bit first, stopping early at a leaf.
+ * Nothing to do for a tree that's only a leaf, which codes nothing.
+ */
+void buildDecodeTable(struct TableEntry table[], struct QueueNode* root)
+{
+  struct QueueNode* node;
+  int pattern, bit;
+
+  if(root == NULL || root->left == NULL) return;
+
+  for(pattern = 0; pattern < 1 << decodeTableBits; pattern++)
+  {
+    node = root;
+    for(bit = 0; bit < decodeTableBits && node->left != NULL; bit++)
+      node = (pattern >> bit) & 1 ? node->right : node->left;
+
+    table[pattern].node = node;
+    table[pattern].length = bit;
+  }
+}
+
+/*****************************************************************
+ * void crcInit()
+ *
+ * Fills crcTable for the CRC32C (Castagnoli) software path, and
+ * checks whether the CPU can do it with SSE4.2 instead.
+ */
+void crcInit()
+{
+  unsigned int crc;
+  int i, j;
+
+  for(i = 0; i < 256; i++)
+  {
+    crc = i;
+    for(j = 0; j < 8; j++)
+      crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    crcTable[0][i] = crc;
+  }
+
+  for(i = 0; i < 256; i++)
+    for(j = 1; j < 8; j++)
+      crcTable[j][i] = (crcTable[j - 1][i] >> 8) ^ crcTable[0][crcTable[j - 1][i] & 0xFF];
+
+#ifdef crcHardware
+  __builtin_cpu_init();
+  crcHasHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#ifdef crcHardware
+/*****************************************************************
+ * unsigned int crcSse42(unsigned int crc, const unsigned char* data,
+ *                       size_t length)
+ *
+ * CRC32C of length bytes at data with the SSE4.2 crc32 instruction,
+ * 8 bytes at a time. crc is the running value, already inverted.
+ */
+__attribute__((target("sse4.2")))
+unsigned int crcSse42(unsigned int crc, const unsigned char* data, size_t length)
+{
+  unsigned long wide = crc, word;
+
+  while(length >= 8)
+  {
+    memcpy(&word, data, 8);
+    wide = _mm_crc32_u64(wide, word);
+    data += 8;
+    length -= 8;
+  }
+
+  crc = wide;
+  while(length--)
+    crc = _mm_crc32_u8(crc, *data++);
+
+  return crc;
+}
+#endif
+
+/*****************************************************************
+ * unsigned int crc32c(unsigned int crc, const unsigned char* data,
+ *                     size_t length)
+ *
+ * Returns the CRC32C of the length bytes at data, carrying on from
+ * crc, the CRC32C of everything before (0 to start).
+ */
+unsigned int crc32c(unsigned int crc, const unsigned char* data, size_t length)
+{
+  crc = ~crc;
+
+#ifdef crcHardware
+  if(crcHasHardware) return ~crcSse42(crc, data, length);
+#endif
+
+  /* Slicing by 8 */
+  while(length >= 8)
+  {
+    crc ^= data[0] | data[1] << 8 | data[2] << 16 | (unsigned int) data[3] << 24;
+    crc = crcTable[7][crc & 0xFF] ^ crcTable[6][(crc >> 8) & 0xFF]
+      ^ crcTable[5][(crc >> 16) & 0xFF] ^ crcTable[4][crc >> 24]
+      ^ crcTable[3][data[4]] ^ crcTable[2][data[5]]
+      ^ crcTable[1][data[6]] ^ crcTable[0][data[7]];
+    data += 8;
+    length -= 8;
+  }
+
+  while(length--)
+    crc = (crc >> 8) ^ crcTable[0][(crc ^ *data++) & 0xFF];
+
+  return ~crc;
+}
+
+/*************************************************************
+ * void ringInit(struct BlockRing* ring)
+ *
+ * Readies ring for use, empty.
+ */
+void ringInit(struct BlockRing* ring)
+{
+  ring->head = 0;
+  ring->tail = 0;
+  ring->waiting = 0;
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->wake, NULL);
+}
+
+/*************************************************************
+ * void ringFree(struct BlockRing* ring)
+ *
+ * Releases what ringInit set up, once no thread uses ring.
+ */
+void ringFree(struct BlockRing* ring)
+{
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->wake);
+}
+
+/*************************************************************
+ * void ringPush(struct BlockRing* ring, struct Block* block)
+ *
+ * Hands block to the single consumer of ring. Each ring is
+ * as big as the pool of blocks using it, so it can never be
+ * full.
+ */
+void ringPush(struct BlockRing* ring, struct Block* block)
+{
+  unsigned long tail = ring->tail;
+
+  ring->slots[tail % ringSize] = block;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+  /* Moving tail before looking at waiting means a consumer about
+     to sleep either sees the block or gets woken */
+  if(__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST))
+  {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_signal(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+/***************************************************************
+ * struct Block* ringPop(struct BlockRing* ring)
+ *
+ * Takes the oldest block off ring. While the producer on the other
+ * side has nothing ready it yields the CPU ringSpins times, then
+ * sleeps until the next push.
+ */
+struct Block* ringPop(struct BlockRing* ring)
+{
+  unsigned long head = ring->head;
+  struct Block* block;
+  int spins = 0;
+
+  while(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+  {
+    if(spins++ < ringSpins)
+    {
+      sched_yield();
+      continue;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head)
+      pthread_cond_wait(&ring->wake, &ring->lock);
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ring->lock);
+  }
+
+  block = ring->slots[head % ringSize];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return block;
+}
+
+/*****************************************************************
+ * int unsorterFit(struct Unsorter* u, unsigned long length,
+ *                 unsigned long count)
+ *
+ * Grows u, if need be, to undo a block of length bytes sorted into
+ * count symbols. Returns 0 if there isn't the memory.
+ */
+int unsorterFit(struct Unsorter* u, unsigned long length, unsigned long count)
+{
+  if(count > u->symbolRoom)
+  {
+    free(u->symbols);
+    u->symbols = malloc(count);
+    u->symbolRoom = u->symbols != NULL ? count : 0;
+  }
+
+  if(length > u->room)
+  {
+    free(u->links);
+    free(u->out);
+    u->links = malloc((length + 1) * sizeof(unsigned int));
+    u->out = malloc(length);
+    u->room = u->links != NULL && u->out != NULL ? length : 0;
+  }
+
+  return u->symbolRoom >= count && u->room >= length;
+}
+
+/*****************************************************************
+ * void unsorterFree(struct Unsorter* u)
+ *
+ * Frees the room in u, leaving it empty.
+ */
+void unsorterFree(struct Unsorter* u)
+{
+  free(u->symbols);
+  free(u->links);
+  free(u->out);
+  memset(u, 0, sizeof(struct Unsorter));
+}
+
+/*****************************************************************
+ * int unsort(struct Unsorter* u, const unsigned char* symbols,
+ *            unsigned long count, unsigned long primary,
+ *            unsigned long length)
+ *
+ * Undoes huffencode's block sorting, turning the count symbols at
+ * symbols back into the length bytes at u->out, which unsorterFit
+ * must have made room for. The zero runs and move-to-front ranks
+ * give the last column of the sorted rotations, less the primary
+ * row. Each row is then linked to the row of the rotation one byte
+ * later, and following the links from the primary row spells out
+ * the block. Returns 0 if the symbols don't make a block of that
+ * length.
+ */
+int unsort(struct Unsorter* u, const unsigned char* symbols, unsigned long count,
+	   unsigned long primary, unsigned long length)
+{
+  unsigned int* links = u->links;
+  unsigned char order[256], c;
+  unsigned long starts[256];
+  unsigned long i, k = 0, row, run = 0, weight = 1, sum, n;
+  int rank;
+
+  if(primary < 1 || primary > length) return 0;
+
+  memset(links, 0, (length + 1) * sizeof(unsigned int));
+  for(i = 0; i < 256; i++)
+  {
+    order[i] = i;
+    starts[i] = 0;
+  }
+
+  /* Put the last column in the low bits of links, counting each
+     byte; a run of the front byte is written out when it ends */
+  for(i = 0; i <= count; i++)
+  {
+    if(i < count && symbols[i] <= runB)
+    {
+      run += weight << symbols[i];
+      weight <<= 1;
+      if(run > length - k) return 0;
+      continue;
+    }
+
+    for(; run > 0; run--, k++)
+    {
+      links[k < primary ? k : k + 1] = order[0];
+      starts[order[0]]++;
+    }
+    weight = 1;
+    if(i == count) break;
+
+    rank = symbols[i] - 1;
+    if(symbols[i] == rankEscape)
+    {
+      if(++i == count || symbols[i] > 1) return 0;
+      rank = rankEscape - 1 + symbols[i];
+    }
+    if(k == length) return 0;
+
+    c = order[rank];
+    memmove(order + 1, order, rank);
+    order[0] = c;
+
+    links[k < primary ? k : k + 1] = c;
+    starts[c]++;
+    k++;
+  }
+
+  if(k != length) return 0;
+
+  /* The first row of each byte's, after the primary row's, which
+     sorts first since it starts the block */
+  for(i = 0, sum = 1; i < 256; i++)
+  {
+    n = starts[i];
+    starts[i] = sum;
+    sum += n;
+  }
+
+  /* A byte's rows keep their order when moved back a byte */
+  links[0] |= primary << 8;
+  for(row = 0; row <= length; row++)
+    if(row != primary) links[starts[links[row] & 0xFF]++] |= row << 8;
+
+  row = primary;
+  for(i = 0; i < length; i++)
+  {
+    row = links[row] >> 8;
+    u->out[i] = links[row] & 0xFF;
+  }
+
+  return 1;
+}
+
+/*****************************************************************
+ * void decodeInit(struct DecodeContext* ctx)
+ *
+ * Readies ctx to decode a new stream from its first byte.
+ */
+void decodeInit(struct DecodeContext* ctx)
+{
+  memset(ctx, 0, sizeof(struct DecodeContext));
+  ctx->state = stateMagic;
+  ctx->need = frameMagicLength;
+}
+
+/*****************************************************************
+ * int decodeFinish(struct DecodeContext* ctx)
+ *
+ * Called once the input has run out. Returns 1 if it ended
+ * cleanly between two frames, after at least one.
+ */
+int decodeFinish(struct DecodeContext* ctx)
+{
+  return ctx->state == stateMagic && ctx->have == 0 && ctx->frames > 0;
+}
+
+/*****************************************************************
+ * void decodeEnd(struct DecodeContext* ctx)
+ *
+ * Frees the Huffman tree ctx built from the stream's header, and
+ * any room it took to undo block sorting.
+ */
+void decodeEnd(struct DecodeContext* ctx)
+{
+  freeTree(ctx->root);
+  ctx->root = NULL;
+  unsorterFree(&ctx->unsorter);
+}
+
+/******************************************************************
+ * int gatherField(struct DecodeContext* ctx, const unsigned char** in,
+ *                 size_t* inLength)
+ *
+ * Moves bytes from the input at *in into ctx's field buffer until
+ * it holds ctx->need of them, advancing *in and *inLength past what
+ * was taken. Returns 1 once the field is complete.
+ */
+int gatherField(struct DecodeContext* ctx, const unsigned char** in, size_t* inLength)
+{
+  size_t take = ctx->need - ctx->have;
+
+  if(take > *inLength) take = *inLength;
+
+  memcpy(ctx->field + ctx->have, *in, take);
+  ctx->have += take;
+  *in += take;
+  *inLength -= take;
+
+  return ctx->have == ctx->need;
+}
+
+/******************************************************************
+ * void expectField(struct DecodeContext* ctx, int state, size_t need)
+ *
+ * Moves ctx to state, which starts by gathering a need byte field.
+ */
+void expectField(struct DecodeContext* ctx, int state, size_t need)
+{
+  ctx->state = state;
+  ctx->need = need;
+  ctx->have = 0;
+}
+
+/******************************************************************
+ * void startBlock(struct DecodeContext* ctx)
+ *
+ * Moves ctx on to the next block header, or to the end of the
+ * frame once every character in it has been produced.
+ */
+void startBlock(struct DecodeContext* ctx)
+{
+  size_t header = sizeof(unsigned char) + sizeof(unsigned long);
+
+  if(ctx->version > 1) header += sizeof(unsigned int);
+
+  if(ctx->charCount < ctx->totalChars) expectField(ctx, stateBlockHeader, header);
+  else if(ctx->version > 1) expectField(ctx, stateStreamCrc, sizeof(unsigned int));
+  else ctx->state = stateFrameEnd;
+}
+
+/******************************************************************
+ * void endBlock(struct DecodeContext* ctx)
+ *
+ * Checks the block ctx just finished against the CRC32C in its
+ * header, if it had one, then moves on to the next.
+ */
+void endBlock(struct DecodeContext* ctx)
+{
+  if(ctx->version > 1 && ctx->crc != ctx->blockCrc)
+  {
+    ctx->state = stateError;
+    return;
+  }
+
+  ctx->streamCrc = crc32c(ctx->streamCrc, (unsigned char*) &ctx->blockCrc, sizeof(unsigned int));
+  startBlock(ctx);
+}
+
+/*****************************************************************
+ * void decodeSpan(struct DecodeContext* ctx, struct QueueNode* root,
+ *                 unsigned long length, int version)
+ *
+ * Readies ctx to decode the blocks of an archive member, which has
+ * no frame header of its own: length characters coded with the
+ * shared tree at root, in an archive of that format version. ctx
+ * takes the tree over.
+ */
+void decodeSpan(struct DecodeContext* ctx, struct QueueNode* root, unsigned long length, int version)
+{
+  ctx->version = version;
+  ctx->streamCrc = 0;
+  ctx->root = root;
+  ctx->current = root;
+  buildDecodeTable(ctx->table, ctx->root);
+  ctx->totalChars = length;
+  ctx->charCount = 0;
+  startBlock(ctx);
+}
+
+/******************************************************************
+ * void parseField(struct DecodeContext* ctx)
+ *
+ * Acts on the field ctx just finished gathering: the parts of the
+ * frame header, which build the Huffman tree, and each block's
+ * header.
+ */
+void parseField(struct DecodeContext* ctx)
+{
+  unsigned char data;
+  unsigned long frequency;
+
+  switch(ctx->state)
+  {
+  case stateMagic:
+    ctx->version = ctx->field[frameMagicLength - 1];
+    if(memcmp(ctx->field, frameMagic, frameMagicLength - 1) != 0
+       || ctx->version < 1 || ctx->version > newestFormatVersion)
+      ctx->state = stateError;
+    else expectField(ctx, stateSymbolCount, sizeof(unsigned short));
+    break;
+
+  case stateSymbolCount:
+    memcpy(&ctx->symbolsLeft, ctx->field, sizeof(unsigned short));
+    if(ctx->symbolsLeft > 256) ctx->state = stateError;
+    else if(ctx->symbolsLeft == 0) expectField(ctx, stateTotal, sizeof(unsigned long));
+    else expectField(ctx, stateSymbol, sizeof(unsigned char) + sizeof(unsigned long));
+    break;
+
+  case stateSymbol:
+    /* Build up the linked list as we go with the stored values */
+    data = ctx->field[0];
+    memcpy(&frequency, ctx->field + 1, sizeof(unsigned long));
+    ctx->root = createNodeLinked(ctx->root, data, frequency);
+
+    if(--ctx->symbolsLeft == 0) expectField(ctx, stateTotal, sizeof(unsigned long));
+    else ctx->have = 0;
+    break;
+
+  case stateTotal:
+    memcpy(&ctx->totalChars, ctx->field, sizeof(unsigned long));
+
+    /* Build the Huffman tree from the existing linked list */
+    if(ctx->root != NULL) ctx->root = buildTree(ctx->root);
+    ctx->current = ctx->root;
+    buildDecodeTable(ctx->table, ctx->root);
+    ctx->streamCrc = 0;
+    startBlock(ctx);
+    break;
+
+  case stateBlockHeader:
+    ctx->mode = ctx->field[0];
+    memcpy(&ctx->blockLeft, ctx->field + 1, sizeof(unsigned long));
+    memcpy(&ctx->blockCrc, ctx->field + 1 + sizeof(unsigned long), sizeof(unsigned int));
+    ctx->crc = 0;
+
+    if(ctx->blockLeft == 0 || ctx->blockLeft > ctx->totalChars - ctx->charCount)
+      ctx->state = stateError;
+
+    /* A tree that's only a leaf codes nothing */
+    else if(ctx->mode == blockHuffman && ctx->root != NULL && ctx->root->left != NULL)
+      expectField(ctx, stateCodedLength, sizeof(unsigned long));
+
+    else if(ctx->mode == blockStored) ctx->state = stateStored;
+    else if(ctx->mode == blockSingle) expectField(ctx, stateSingleSymbol, 1);
+
+    else if(ctx->mode == blockSorted && ctx->version > 2
+	    && ctx->root != NULL && ctx->root->left != NULL)
+      expectField(ctx, stateSortedHeader, 3 * sizeof(unsigned long));
+
+    else ctx->state = stateError;
+    break;
+
+  /* The symbols are decoded first, then put back in order */
+  case stateSortedHeader:
+    ctx->unsortedLength = ctx->blockLeft;
+    memcpy(&ctx->primary, ctx->field, sizeof(unsigned long));
+    memcpy(&ctx->symbolCount, ctx->field + sizeof(unsigned long), sizeof(unsigned long));
+    memcpy(&ctx->codedLeft, ctx->field + 2 * sizeof(unsigned long), sizeof(unsigned long));
+
+    if(ctx->unsortedLength > maxSortedLength
+       || ctx->symbolCount == 0 || ctx->symbolCount > 2 * ctx->unsortedLength
+       || !unsorterFit(&ctx->unsorter, ctx->unsortedLength, ctx->symbolCount))
+      ctx->state = stateError;
+
+    else
+    {
+      ctx->blockLeft = ctx->symbolCount;
+      ctx->bitBuffer = 0;
+      ctx->bitCount = 0;
+      ctx->state = stateHuffman;
+    }
+    break;
+
+  case stateCodedLength:
+    memcpy(&ctx->codedLeft, ctx->field, sizeof(unsigned long));
+    ctx->bitBuffer = 0;
+    ctx->bitCount = 0;
+    ctx->state = stateHuffman;
+    break;
+
+  case stateSingleSymbol:
+    ctx->symbol = ctx->field[0];
+    ctx->state = stateSingle;
+    break;
+
+  case stateStreamCrc:
+    if(memcmp(ctx->field, &ctx->streamCrc, sizeof(unsigned int)) != 0) ctx->state = stateError;
+    else ctx->state = stateFrameEnd;
+    break;
+  }
+}
+
+/****************************************************************
+ * int traverseTree(struct DecodeContext* ctx, const unsigned char** in,
+ *                  size_t* inLength, unsigned char** out, size_t* outRoom)
+ *
+ * The function traverses the existing Huffman tree at ctx's root.
+ * It takes coded bytes from *in and when a leaf is reached by going
+ * left (bit is 0) or right (bit is 1), puts that character at *out,
+ * until the block is done or either side runs out. From the top of
+ * the tree, with enough bits on hand, it takes decodeTableBits steps
+ * at once through ctx's table. The bits not yet walked and the place
+ * in the tree carry over to the next call. Returns 0 if the block's
+ * coded bytes ran out before its characters.
+ */
+int traverseTree(struct DecodeContext* ctx, const unsigned char** in,
+		 size_t* inLength, unsigned char** out, size_t* outRoom)
+{
+  struct QueueNode* head = ctx->root;
+  struct QueueNode* current = ctx->current;
+  struct TableEntry* entry;
+  unsigned long bitBuffer = ctx->bitBuffer;
+  int bits = ctx->bitCount;
+  const unsigned char* from = *in;
+  size_t inLeft = *inLength;
+  unsigned long codedLeft = ctx->codedLeft;
+  unsigned char* to = *out;
+  size_t room = *outRoom;
+  unsigned long blockLeft = ctx->blockLeft;
+  int ok = 1;
+
+  while(blockLeft > 0 && room > 0)
+  {
+    /* Top up the bits on hand from the block's coded bytes */
+    while(bits <= 24 && codedLeft > 0 && inLeft > 0)
+    {
+      bitBuffer |= (unsigned long) *from++ << bits;
+      bits += 8;
+      inLeft--;
+      codedLeft--;
+    }
+
+    if(current == head && bits >= decodeTableBits)
+    {
+      entry = &ctx->table[bitBuffer & ((1 << decodeTableBits) - 1)];
+      current = entry->node;
+      bitBuffer >>= entry->length;
+      bits -= entry->length;
+    }
+
+    else
+    {
+      if(bits == 0)
+      {
+	if(codedLeft == 0) ok = 0;
+	break;
+      }
+
+      if(bitBuffer & 1) current = current->right;
+      else current = current->left;
+      bitBuffer >>= 1;
+      bits--;
+    }
+
+    if(current->left == NULL && current->right == NULL)
+    {
+      *to++ = current->data;
+      room--;
+      blockLeft--;
+      current = head;
+    }
+  }
+
+  ctx->blockLeft = blockLeft;
+  ctx->codedLeft = codedLeft;
+  ctx->current = current;
+  ctx->bitBuffer = bitBuffer;
+  ctx->bitCount = bits;
+  *in = from;
+  *inLength = inLeft;
+  *out = to;
+  *outRoom = room;
+
+  /* The rest of the bits on hand are padding */
+  if(blockLeft == 0)
+  {
+    ctx->bitBuffer = 0;
+    ctx->bitCount = 0;
+  }
+  return ok;
+}
+
+/**********************************************************************
+ * int decodeChunk(struct DecodeContext* ctx,
+ *                 const unsigned char* in, size_t inLength, size_t* inUsed,
+ *                 unsigned char* out, size_t outRoom, size_t* outMade)
+ *
+ * Push-style decoder. Feeds the inLength bytes at in to ctx, writing
+ * decoded characters to the outRoom bytes at out. On return *inUsed
+ * and *outMade say how much of each was used; what's left of the
+ * input should be offered again along with more, once the output has
+ * been drained. All state is kept in ctx, so the stream may be split
+ * anywhere. A stream is any number of frames back to back. Returns
+ * decodeFrame straight after finishing one, decodeError if the stream
+ * is malformed or a block or frame fails its checksum, and otherwise
+ * decodeMore. Once the input runs out, decodeFinish says whether it
+ * ended where it should.
+ */
+int decodeChunk(struct DecodeContext* ctx,
+		const unsigned char* in, size_t inLength, size_t* inUsed,
+		unsigned char* out, size_t outRoom, size_t* outMade)
+{
+  const unsigned char* inStart = in;
+  unsigned char* outStart = out;
+  unsigned char* made;
+  unsigned char* sorted;
+  size_t n;
+  int walked;
+
+  for(;;)
+  {
+    if(ctx->state == stateError) break;
+
+    /* Drop the frame's tree and look for the next one */
+    else if(ctx->state == stateFrameEnd)
+    {
+      decodeEnd(ctx);
+      ctx->frames++;
+      ctx->checkedChars += ctx->charCount;
+      ctx->charCount = 0;
+      expectField(ctx, stateMagic, frameMagicLength);
+
+      *inUsed = in - inStart;
+      *outMade = out - outStart;
+      return decodeFrame;
+    }
+
+    /* Copy a stored block straight through */
+    else if(ctx->state == stateStored)
+    {
+      n = ctx->blockLeft;
+      if(n > inLength) n = inLength;
+      if(n > outRoom) n = outRoom;
+      if(n == 0) break;
+
+      memcpy(out, in, n);
+      ctx->crc = crc32c(ctx->crc, out, n);
+      in += n;
+      inLength -= n;
+      out += n;
+      outRoom -= n;
+      ctx->blockLeft -= n;
+      ctx->charCount += n;
+      if(ctx->blockLeft == 0) endBlock(ctx);
+    }
+
+    /* Fill in a single-symbol block */
+    else if(ctx->state == stateSingle)
+    {
+      n = ctx->blockLeft;
+      if(n > outRoom) n = outRoom;
+      if(n == 0) break;
+
+      memset(out, ctx->symbol, n);
+      ctx->crc = crc32c(ctx->crc, out, n);
+      out += n;
+      outRoom -= n;
+      ctx->blockLeft -= n;
+      ctx->charCount += n;
+      if(ctx->blockLeft == 0) endBlock(ctx);
+    }
+
+    /* Block-sorted symbols go to the unsorter instead */
+    else if(ctx->state == stateHuffman && ctx->mode == blockSorted)
+    {
+      sorted = ctx->unsorter.symbols + ctx->symbolCount - ctx->blockLeft;
+      n = ctx->blockLeft;
+      walked = traverseTree(ctx, &in, &inLength, &sorted, &n);
+
+      if(!walked) ctx->state = stateError;
+      else if(ctx->blockLeft == 0) ctx->state = stateSkip;
+      else break;
+    }
+
+    else if(ctx->state == stateHuffman)
+    {
+      made = out;
+      walked = traverseTree(ctx, &in, &inLength, &out, &outRoom);
+      ctx->crc = crc32c(ctx->crc, made, out - made);
+      ctx->charCount += out - made;
+
+      if(!walked) ctx->state = stateError;
+
+      /* Step over any coded bytes past the last character */
+      else if(ctx->blockLeft == 0)
+	ctx->state = stateSkip;
+
+      else break;
+    }
+
+    else if(ctx->state == stateSkip)
+    {
+      n = ctx->codedLeft;
+      if(n > inLength) n = inLength;
+
+      in += n;
+      inLength -= n;
+      ctx->codedLeft -= n;
+      if(ctx->codedLeft > 0) break;
+
+      if(ctx->mode != blockSorted) endBlock(ctx);
+      else if(!unsort(&ctx->unsorter, ctx->unsorter.symbols, ctx->symbolCount,
+		      ctx->primary, ctx->unsortedLength))
+	ctx->state = stateError;
+      else
+      {
+	ctx->blockLeft = ctx->unsortedLength;
+	ctx->state = stateUnsorted;
+      }
+    }
+
+    /* Copy out a block-sorted block once it's back in order */
+    else if(ctx->state == stateUnsorted)
+    {
+      n = ctx->blockLeft;
+      if(n > outRoom) n = outRoom;
+      if(n == 0) break;
+
+      memcpy(out, ctx->unsorter.out + ctx->unsortedLength - ctx->blockLeft, n);
+      ctx->crc = crc32c(ctx->crc, out, n);
+      out += n;
+      outRoom -= n;
+      ctx->blockLeft -= n;
+      ctx->charCount += n;
+      if(ctx->blockLeft == 0) endBlock(ctx);
+    }
+
+    /* Everything else is a fixed size field */
+    else if(gatherField(ctx, &in, &inLength)) parseField(ctx);
+    else break;
+  }
+
+  *inUsed = in - inStart;
+  *outMade = out - outStart;
+
+  if(ctx->state == stateError) return decodeError;
+  return decodeMore;
+}
+
+/**********************************************************************
+ * int analyzeStream(FILE* in, double percent, size_t blockBytes,
+ *                   int maxLength, struct Analysis* result)
+ *
+ * Dry run of encoding the stream, in, in blocks of blockBytes with
+ * no code longer than maxLength. Counts its bytes and builds the
+ * code lengths the encoder would use, without coding anything,
+ * to find the size of the frame encoding would write (to within a
+ * byte of padding per block, and assuming one kind of block wins
+ * throughout) and the order-0 entropy. If percent isn't 0 the code
+ * lengths come from the same sample, escape path and all, that
+ * sampleFrequencies would take, counted on the way through. Touches
+ * no globals, so it is safe to run on several streams at once.
+ * Returns 0 on a read error.
+ */
+int analyzeStream(FILE* in, double percent, size_t blockBytes, int maxLength,
+		  struct Analysis* result)
+{
+  unsigned long freq[256] = {0}, sampled[256] = {0}, limited[256];
+  unsigned char* buffer = malloc(blockBytes);
+  struct QueueNode* head = NULL;
+  unsigned long blocks, overhead, huffmanBytes, storedBytes, singleBytes;
+  unsigned long size = 0, chunks = 0, stride = 0, pos = 0, at, end, k;
+  int sampling = 0, tableSymbols = 0;
+  size_t length, i;
+  long seen;
+  double p;
+  int c;
+
+  /* Sample where sampleFrequencies would, unless it would count
+     the whole file */
+  if(percent > 0 && fseek(in, 0, SEEK_END) == 0 && (seen = ftell(in)) > 0)
+  {
+    size = seen;
+    chunks = size * (percent / 100) / sampleChunk + 1;
+    stride = size / chunks;
+    sampling = stride > sampleChunk;
+  }
+  rewind(in);
+
+  while((length = fread(buffer, 1, blockBytes, in)) > 0)
+  {
+    for(i = 0; i < length; i++)
+      freq[buffer[i]]++;
+
+    /* The parts of the sample chunks inside this buffer */
+    for(at = pos; sampling && at < pos + length; at = k * stride + stride)
+    {
+      k = at / stride;
+      if(k >= chunks) break;
+
+      end = k * stride + sampleChunk;
+      if(end > pos + length) end = pos + length;
+      for(; at < end; at++)
+	sampled[buffer[at - pos]]++;
+    }
+
+    pos += length;
+  }
+  free(buffer);
+
+  if(ferror(in)) return 0;
+
+  result->inputBytes = 0;
+  result->symbols = 0;
+  result->entropy = 0;
+
+  for(c = 0; c < 256; c++)
+    if(freq[c] > 0)
+    {
+      result->inputBytes += freq[c];
+      result->symbols++;
+    }
+
+  /* Code lengths come from the counts the encoder would write,
+     with nothing left without a code when sampled */
+  for(c = 0; c < 256; c++)
+  {
+    limited[c] = sampling ? sampled[c] + 1 : freq[c];
+    if(limited[c] > 0) tableSymbols++;
+  }
+  if(maxLength < maxHeight) limitCodeLengths(limited, maxLength);
+
+  for(c = 0; c < 256; c++)
+    if(limited[c] > 0)
+      head = createNodeLinked(head, c, limited[c]);
+
+  for(c = 0; c < 256; c++)
+    if(freq[c] > 0)
+    {
+      p = (double) freq[c] / result->inputBytes;
+      result->entropy -= p * log(p) / log(2);
+    }
+
+  /* Frame header and checksum, and every block starts with its mode,
+     length and checksum */
+  blocks = (result->inputBytes + blockBytes - 1) / blockBytes;
+  overhead = frameMagicLength + sizeof(unsigned short)
+    + tableSymbols * (sizeof(unsigned char) + sizeof(unsigned long))
+    + sizeof(unsigned long) + sizeof(unsigned int)
+    + blocks * (sizeof(unsigned char) + sizeof(unsigned long) + sizeof(unsigned int));
+
+  result->estimatedBytes = overhead;
+  if(head == NULL) return 1;
+
+  head = buildTree(head);
+  huffmanBytes = (treeCost(head, freq, 0) + 7) / 8 + blocks * sizeof(unsigned long);
+  storedBytes = result->inputBytes;
+  singleBytes = blocks;
+  freeTree(head);
+
+  if(result->symbols == 1) result->estimatedBytes += singleBytes;
+  else if(huffmanBytes < storedBytes) result->estimatedBytes += huffmanBytes;
+  else result->estimatedBytes += storedBytes;
+
+  return 1;
+}
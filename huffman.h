@@ -0,0 +1,270 @@
+/**************************************************************************/
+/* The parts of Huffman Encode and Huffman Decode that both need: the    */
+/* list/tree hybrid the Huffman tree is built in, CRC32C, the rings the  */
+/* pipeline stages pass blocks around on, and undoing block sorting.     */
+/* Also the push-style decoder and the dry run's analysis of what        */
+/* encoding a stream would give, for any program to build on.            */
+/**************************************************************************/
+
+#ifndef HUFFMAN_H
+#define HUFFMAN_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* The longest a Huffman code can be is 127 */
+#define maxHeight 127
+
+/* Bits the decoder's lookup table steps through the tree at once */
+#define decodeTableBits 12
+
+/* Blocks each ring can hold, which is as many as the stages on
+   either side of it own between them */
+#define ringSize 8
+
+/* Times a stage yields on an empty ring before sleeping on it */
+#define ringSpins 64
+
+/* How each block of a frame is stored */
+#define blockHuffman 0
+#define blockStored 1
+#define blockSingle 2
+#define blockSorted 3
+
+/* Block-sorted symbols: the two digits zero runs are written with,
+   and the one ranks 254 and 255 are written after */
+#define runA 0
+#define runB 1
+#define rankEscape 255
+
+/* Longest block-sorted block, as long as huffencode makes them.
+   Undoing one takes several times its size, so a longer one is
+   treated as corrupt rather than made room for. */
+#define maxSortedLength (1024 * 1024)
+
+/* Every frame starts with these bytes and then the format version:
+   1, 2 which adds checksums, or 3 which adds block-sorted blocks */
+#define frameMagic "HUF"
+#define frameMagicLength 4
+
+/* Multi-file archives start and end with these instead */
+#define archiveMagic "HUA"
+
+/* Newest format version decodeChunk can read */
+#define newestFormatVersion 3
+
+/* Bytes read at each evenly spaced point when sampling the input */
+#define sampleChunk (64 * 1024)
+
+/* What decodeChunk reports back */
+#define decodeMore 0
+#define decodeFrame 1
+#define decodeError 2
+
+/* Where a DecodeContext is in the stream */
+#define stateMagic 0
+#define stateSymbolCount 1
+#define stateSymbol 2
+#define stateTotal 3
+#define stateBlockHeader 4
+#define stateCodedLength 5
+#define stateSingleSymbol 6
+#define stateHuffman 7
+#define stateStored 8
+#define stateSingle 9
+#define stateSkip 10
+#define stateFrameEnd 11
+#define stateStreamCrc 12
+#define stateSortedHeader 13
+#define stateUnsorted 14
+#define stateError 15
+
+/* Does-It-All struct, used for linked list and tree */
+struct QueueNode
+{
+  /* ASCII value of the character */
+  int data;
+
+  /* Frequency of the character */
+  unsigned long frequency;
+
+  /* Left child pointer */
+  struct QueueNode* left;
+
+  /* Right child pointer */
+  struct QueueNode* right;
+
+  /* Next node in list pointer */
+  struct QueueNode* next;
+};
+
+/* One step through the tree from its root, for one pattern of
+   decodeTableBits bits */
+struct TableEntry
+{
+  /* The leaf reached, or the node after all decodeTableBits bits */
+  struct QueueNode* node;
+
+  /* Bits the step used */
+  int length;
+};
+
+/* Each program has its own kind of block; rings only hold pointers */
+struct Block;
+
+/* Bounded single-producer/single-consumer ring of blocks */
+struct BlockRing
+{
+  /* Queued blocks */
+  struct Block* slots[ringSize];
+
+  /* Next slot to take; only moved by the consumer */
+  unsigned long head;
+
+  /* Next slot to fill; only moved by the producer */
+  unsigned long tail;
+
+  /* Set while the consumer sleeps on wake for the ring to fill */
+  int waiting;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+};
+
+/* Room to undo block sorting in, grown to fit the biggest block
+   so far */
+struct Unsorter
+{
+  /* Block-sorted symbols as decoded, and how many fit */
+  unsigned char* symbols;
+  unsigned long symbolRoom;
+
+  /* Every row of the sorted rotations: its last byte in the low 8
+     bits and the row one byte later in the rest */
+  unsigned int* links;
+
+  /* The block put back in order, and how many bytes fit; links has
+     room for one more */
+  unsigned char* out;
+  unsigned long room;
+};
+
+/* Everything needed to pick up decoding a stream where the last
+   chunk of it left off. Other than room to undo block sorting in,
+   its size doesn't depend on the stream's. */
+struct DecodeContext
+{
+  /* One of the state values above */
+  int state;
+
+  /* Header fields and block headers are gathered here whole,
+     however the input is split */
+  unsigned char field[32];
+  size_t need;
+  size_t have;
+
+  /* Symbols still to read from the header */
+  unsigned short symbolsLeft;
+
+  /* Characters in the current frame, and produced so far */
+  unsigned long totalChars;
+  unsigned long charCount;
+
+  /* Frames finished so far, and the characters of those frames,
+     which have checked out whole */
+  unsigned long frames;
+  unsigned long checkedChars;
+
+  /* The frame's format version */
+  int version;
+
+  /* The Huffman tree, and where the walk through it is */
+  struct QueueNode* root;
+  struct QueueNode* current;
+
+  /* Current block's mode, characters still to produce, coded
+     bytes still to read, and repeated symbol */
+  int mode;
+  unsigned long blockLeft;
+  unsigned long codedLeft;
+  unsigned char symbol;
+
+  /* The CRC32C the block's header gave, the CRC32C of what it has
+     produced so far, and the CRC32C of the frame's block CRC32Cs */
+  unsigned int blockCrc;
+  unsigned int crc;
+  unsigned int streamCrc;
+
+  /* Coded bits on hand but not yet walked */
+  unsigned long bitBuffer;
+  int bitCount;
+
+  /* Steps through the tree for every next decodeTableBits bits */
+  struct TableEntry table[1 << decodeTableBits];
+
+  /* A block-sorted block's primary row, characters and symbols,
+     and where the symbols are put back in order */
+  unsigned long primary;
+  unsigned long unsortedLength;
+  unsigned long symbolCount;
+  struct Unsorter unsorter;
+};
+
+/* What a dry run found out about one input */
+struct Analysis
+{
+  /* Size of the input, and of the frame encoding it would write */
+  unsigned long inputBytes;
+  unsigned long estimatedBytes;
+
+  /* Distinct bytes, and order-0 entropy in bits per byte */
+  int symbols;
+  double entropy;
+
+  /* Set if the input couldn't be read */
+  int error;
+};
+
+/* Building and walking the Huffman tree */
+struct QueueNode* insertSorted(struct QueueNode* head, struct QueueNode* newNode);
+struct QueueNode* createNodeLinked(struct QueueNode* head, int data, unsigned long frequency);
+struct QueueNode* createNodeTree(struct QueueNode* head);
+struct QueueNode* buildTree(struct QueueNode* head);
+void freeTree(struct QueueNode* head);
+unsigned long treeCost(struct QueueNode* root, unsigned long freq[], int depth);
+int treeDepth(struct QueueNode* root);
+void limitCodeLengths(unsigned long freq[], int maxLength);
+void buildDecodeTable(struct TableEntry table[], struct QueueNode* root);
+
+/* CRC32C; crcInit must be called once first */
+void crcInit();
+unsigned int crc32c(unsigned int crc, const unsigned char* data, size_t length);
+
+/* Rings of blocks between two stages */
+void ringInit(struct BlockRing* ring);
+void ringFree(struct BlockRing* ring);
+void ringPush(struct BlockRing* ring, struct Block* block);
+struct Block* ringPop(struct BlockRing* ring);
+
+/* Undoing block sorting */
+int unsorterFit(struct Unsorter* u, unsigned long length, unsigned long count);
+void unsorterFree(struct Unsorter* u);
+int unsort(struct Unsorter* u, const unsigned char* symbols, unsigned long count,
+	   unsigned long primary, unsigned long length);
+
+/* The push-style decoder */
+void decodeInit(struct DecodeContext* ctx);
+int decodeChunk(struct DecodeContext* ctx,
+		const unsigned char* in, size_t inLength, size_t* inUsed,
+		unsigned char* out, size_t outRoom, size_t* outMade);
+int decodeFinish(struct DecodeContext* ctx);
+void decodeEnd(struct DecodeContext* ctx);
+void decodeSpan(struct DecodeContext* ctx, struct QueueNode* root, unsigned long length, int version);
+int traverseTree(struct DecodeContext* ctx, const unsigned char** in,
+		 size_t* inLength, unsigned char** out, size_t* outRoom);
+
+/* What encoding a stream would give */
+int analyzeStream(FILE* in, double percent, size_t blockBytes, int maxLength,
+		  struct Analysis* result);
+
+#endif
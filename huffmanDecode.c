@@ -16,220 +16,996 @@
 
 
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "huffman.h"
+
+/* Size of the buffers passed between the stages */
+#define blockSize (256 * 1024)
+
+/* Most threads --test checks blocks on */
+#define maxLanes 64
+
+/* Smallest directory entry: an empty name's length, then its
+   offset, size and coded size */
+#define directoryEntryMinimum (sizeof(unsigned short) + 3 * sizeof(unsigned long))
+
+/* One file stored in an archive, from its central directory */
+struct Member
+{
+  char* name;
+
+  /* Where its blocks start, and its size before and after coding */
+  unsigned long offset;
+  unsigned long size;
+  unsigned long codedSize;
+};
+
+/* A buffer of bytes, recycled between two stages */
+struct Block
+{
+  unsigned char* data;
+  size_t length;
+
+  /* Set on the block that marks the end of the stream */
+  int last;
+
+  /* The rest describe a block for --test to check: its mode,
+     characters, CRC32C and position in its file, the format version
+     and tree it was coded with, and which frame that tree is from */
+  int mode;
+  unsigned long rawLength;
+  unsigned int crc;
+  unsigned long seq;
+  int version;
+  struct QueueNode* root;
+  unsigned long frame;
+
+  /* A block-sorted block's primary row and symbol count */
+  unsigned long primary;
+  unsigned long symbolCount;
+
+  /* Bytes data has room for */
+  size_t capacity;
+
+  /* Set by the checker if the block is corrupt */
+  int bad;
+};
+
+/* The reader, decoder and writer stages and the rings between them */
+struct Pipeline
+{
+  FILE* input;
+  FILE* output;
+
+  /* Bytes the reader may still take from input */
+  unsigned long inputLeft;
 
-/* The longest a Huffman code can be is 127 */
-#define maxHeight 127
+  /* Where decoding picks up from */
+  struct DecodeContext* ctx;
 
-/* Holds the Huffman Codes for each used character */
-int huffmanValues[256][maxHeight];
+  /* Coded input: reader to decoder and back */
+  struct BlockRing inFull;
+  struct BlockRing inFree;
 
-/* The number of unique symbols in the file being decoded
-   (when it's unencoded) */
-int numSymbols;
+  /* Decoded output: decoder to writer and back */
+  struct BlockRing outFull;
+  struct BlockRing outFree;
 
-/* The total number of characters in the file
-   (when it's unencoded) */
-int totalChars;
+  struct Block inBlocks[ringSize];
+  struct Block outBlocks[ringSize];
 
-/* Does-It-All struct, used for linked list and tree */
-struct QueueNode
+  /* Set if the input ended early or didn't make sense */
+  int error;
+
+  /* Set by the writer once output fails to write, which stops the
+     decoder too */
+  int writeFailed;
+};
+
+/* One checker thread for --test, and the blocks dealt to it */
+struct TestLane
 {
-  /* ASCII value of the character */
-  int data;
+  /* Blocks to check, and checked blocks coming back */
+  struct BlockRing toChecker;
+  struct BlockRing toParser;
+  struct Block blocks[ringSize];
+
+  /* Blocks back from the checker, ready to fill again */
+  struct Block* spare[ringSize];
+  int spareCount;
+
+  /* The checker's decoder state and the frame its table was built
+     for, and room to decode into */
+  struct DecodeContext* ctx;
+  unsigned long frame;
+  unsigned char* scratch;
+  size_t scratchSize;
 
-  /* Frequency of the character */
-  int frequency;
+  pthread_t thread;
+};
+
+/* What --test keeps track of across the files it checks */
+struct Tester
+{
+  /* Blocks are dealt to the lanes round-robin, in file order */
+  struct TestLane* lanes;
+  int laneCount;
+  int next;
 
-  /* Left child pointer */
-  struct QueueNode* left;
+  /* Frames read so far, which tells checkers when to build their
+     tables again */
+  unsigned long frame;
 
-  /* Right child pointer */
-  struct QueueNode* right;
+  /* The file being checked, its size, its blocks so far and how
+     many of them were corrupt */
+  char* name;
+  unsigned long size;
+  unsigned long seq;
+  unsigned long badBlocks;
 
-  /* Next node in list pointer */
-  struct QueueNode* next;
+  /* Blocks and decoded bytes checked in every file */
+  unsigned long blocks;
+  unsigned long bytes;
 };
 
 
-/***********************************************************************************
- * struct QueueNode* insertSorted(struct QueunNode* head, struct QueueNode* newNode)
+/*****************************************************************
+ * void* readerStage(void* arg)
  *
- * The function inserts a node, newNode, into the list/tree hybrid pointed to
- * by head. It returns the (possibly new) head.
+ * Reader thread. Fills recycled blocks with coded bytes from the
+ * input stream until EOF or its limit, which it passes on as an
+ * empty block.
  */
-struct QueueNode* insertSorted(struct QueueNode* head, struct QueueNode* newNode)
+void* readerStage(void* arg)
 {
-  struct QueueNode* current = head;
+  struct Pipeline* pipe = arg;
+  struct Block* block;
+  int last;
 
-  /* If the list-tree is empty or the new node's frequency is less than
-     the smallest (head) node's frequency, add it there */
-  if(head == NULL || newNode->frequency < head->frequency)
+  do
   {
-    newNode->next = current;
-    return newNode;
-  }
+    block = ringPop(&pipe->inFree);
+    block->length = fread(block->data, 1,
+			  pipe->inputLeft < blockSize ? pipe->inputLeft : blockSize, pipe->input);
+    pipe->inputLeft -= block->length;
+    block->last = last = block->length == 0;
 
-  /* Keep checking that there is another node after current node and next node
-     freq is less than new node's freq, then put the new node at the current
-     position (where either of these are untrue: end of list or
-     new node < existing node) */
+    /* Once pushed, the block belongs to the decoder */
+    ringPush(&pipe->inFull, block);
+  } while(!last);
 
-  else
+  return NULL;
+}
+
+/*****************************************************************
+ * void* decodeStage(void* arg)
+ *
+ * Decoder thread. Pushes each block from the reader through the
+ * pipeline's DecodeContext, handing output blocks to the writer as
+ * they fill.
+ * Sets the pipeline's error flag if the stream is short or corrupt.
+ */
+void* decodeStage(void* arg)
+{
+  struct Pipeline* pipe = arg;
+  struct DecodeContext* ctx = pipe->ctx;
+  struct Block* in = ringPop(&pipe->inFull);
+  struct Block* out = ringPop(&pipe->outFree);
+  size_t inPos = 0, inUsed, outMade;
+  int status = decodeMore;
+  out->length = 0;
+  out->last = 0;
+
+  while(status != decodeError && !__atomic_load_n(&pipe->writeFailed, __ATOMIC_RELAXED))
   {
-    /* Comparing unequal frequencies */
-    while(current->next != NULL && current->next->frequency < newNode->frequency)
-      current = current->next;
+    status = decodeChunk(ctx, in->data + inPos, in->length - inPos, &inUsed,
+			 out->data + out->length, blockSize - out->length, &outMade);
+    inPos += inUsed;
+    out->length += outMade;
 
-    if(head->frequency == newNode->frequency && head->data > newNode->data)
+    if(out->length == blockSize)
     {
-      newNode->next = current;
-      return newNode;
+      ringPush(&pipe->outFull, out);
+      out = ringPop(&pipe->outFree);
+      out->length = 0;
+      out->last = 0;
     }
 
-    /* Comparing unequal data (ASCII) values with equal frequency values */
-    while(current->next != NULL && current->next->frequency == newNode->frequency &&
-	  current->next->data < newNode->data)
-      current = current->next;
+    if(inPos == in->length)
+    {
+      /* At EOF, carry on only while output is still coming */
+      if(in->last)
+      {
+	if(outMade == 0 && status == decodeMore) break;
+      }
+
+      else
+      {
+	ringPush(&pipe->inFree, in);
+	in = ringPop(&pipe->inFull);
+	inPos = 0;
+      }
+    }
+  }
+
+  pipe->error = status == decodeError || !decodeFinish(ctx);
+  decodeEnd(ctx);
+
+  /* Keep draining the reader to EOF even once done decoding */
+  while(!in->last)
+  {
+    ringPush(&pipe->inFree, in);
+    in = ringPop(&pipe->inFull);
+  }
+
+  /* Flush what's left, then mark the end for the writer */
+  if(out->length)
+  {
+    ringPush(&pipe->outFull, out);
+    out = ringPop(&pipe->outFree);
+    out->length = 0;
+  }
+  out->last = 1;
+  ringPush(&pipe->outFull, out);
+
+  return NULL;
+}
+
+/***************************************************************
+ * int decode(FILE* in, FILE* out, struct DecodeContext* ctx,
+ *            unsigned long inputLength)
+ *
+ * Decodes up to inputLength bytes of the stream in to out, carrying
+ * on from ctx. A reader thread, the decoding thread and the writer
+ * (run on this thread) overlap disk and CPU work through rings of
+ * recycled blocks. Returns 0 if the input was short or corrupt, or
+ * the output couldn't all be written, which leaves ferror(out) set.
+ */
+int decode(FILE* in, FILE* out, struct DecodeContext* ctx, unsigned long inputLength)
+{
+  struct Pipeline pipe;
+  pthread_t reader, decoder;
+  struct Block* block;
+  int i;
+
+  pipe.input = in;
+  pipe.output = out;
+  pipe.inputLeft = inputLength;
+  pipe.ctx = ctx;
+  pipe.error = 0;
+  pipe.writeFailed = 0;
+  ringInit(&pipe.inFull);
+  ringInit(&pipe.inFree);
+  ringInit(&pipe.outFull);
+  ringInit(&pipe.outFree);
+
+  for(i = 0; i < ringSize; i++)
+  {
+    pipe.inBlocks[i].data = malloc(blockSize);
+    pipe.outBlocks[i].data = malloc(blockSize);
+    ringPush(&pipe.inFree, &pipe.inBlocks[i]);
+    ringPush(&pipe.outFree, &pipe.outBlocks[i]);
+  }
+
+  pthread_create(&reader, NULL, readerStage, &pipe);
+  pthread_create(&decoder, NULL, decodeStage, &pipe);
+
+  /* Writer stage */
+  while(!(block = ringPop(&pipe.outFull))->last)
+  {
+    if(!pipe.writeFailed && fwrite(block->data, 1, block->length, out) != block->length)
+      __atomic_store_n(&pipe.writeFailed, 1, __ATOMIC_RELAXED);
+    ringPush(&pipe.outFree, block);
+  }
+
+  pthread_join(reader, NULL);
+  pthread_join(decoder, NULL);
+
+  if(fflush(out) != 0 || ferror(out)) pipe.writeFailed = 1;
+
+  for(i = 0; i < ringSize; i++)
+  {
+    free(pipe.inBlocks[i].data);
+    free(pipe.outBlocks[i].data);
+  }
+  ringFree(&pipe.inFull);
+  ringFree(&pipe.inFree);
+  ringFree(&pipe.outFull);
+  ringFree(&pipe.outFree);
+
+  return !pipe.error && !pipe.writeFailed;
+}
+
+/******************************************************************
+ * struct QueueNode* readTable(FILE* in)
+ *
+ * Reads a symbol count and that many symbols and frequencies from
+ * in, as written by huffencode, and builds their Huffman tree.
+ * Returns NULL if there were no symbols.
+ */
+struct QueueNode* readTable(FILE* in)
+{
+  struct QueueNode* head = NULL;
+  unsigned short numSymbols = 0;
+  unsigned char data;
+  unsigned long frequency;
+
+  /* Read the number of unique symbols number from the file */
+  fread(&numSymbols, sizeof(unsigned short), 1, in);
+
+  /* Read until we have correct amount of symbols and their
+     frequencies */
+  while(numSymbols && numSymbols <= 256)
+  {
+    if(fread(&data, sizeof(unsigned char), 1, in) != 1
+       || fread(&frequency, sizeof(unsigned long), 1, in) != 1)
+      break;
+
+    /* Build up the linked list as we go with the stored values */
+    head = createNodeLinked(head, data, frequency);
+
+    numSymbols--;
   }
-  newNode->next = current->next;
-  current->next = newNode;
+
+  /* Build the Huffman tree from the existing linked list */
+  if(head != NULL) head = buildTree(head);
   return head;
 }
 
+/*****************************************************************
+ * void freeDirectory(struct Member* members, unsigned long count)
+ *
+ * Frees a directory read by readDirectory.
+ */
+void freeDirectory(struct Member* members, unsigned long count)
+{
+  unsigned long i;
+
+  for(i = 0; i < count; i++)
+    free(members[i].name);
+  free(members);
+}
 
-/**************************************************************************************
- * struct QueueNode* createNodeLinked(struct QueueNode* head, int data, int frequency)
+/******************************************************************
+ * struct Member* readDirectory(FILE* in, unsigned long* count,
+ *                             int* version)
  *
- * The function creates a new linked list node with character denoted by  data,
- * and frequency denoted by frequency. It then calls another function to insert it
- * appropriately in the list pointed to by head. It returns the (possibly new) head.
+ * Finds the central directory from the trailer at the end of the
+ * archive in and reads it, setting *count to the number of members
+ * and *version to the archive's format version. Returns NULL if in
+ * isn't an archive, or its trailer gives a directory that can't
+ * fit before it.
  */
-struct QueueNode* createNodeLinked(struct QueueNode* head, int data, int frequency)
+struct Member* readDirectory(FILE* in, unsigned long* count, int* version)
 {
-  /* Make space for new node to insert */
-  struct QueueNode* newNode = malloc(sizeof(struct QueueNode));
+  unsigned char magic[frameMagicLength];
+  unsigned long offset, i;
+  unsigned short nameLength;
+  struct Member* members;
+  long trailer;
+
+  if(fread(magic, 1, frameMagicLength, in) != frameMagicLength
+     || memcmp(magic, archiveMagic, frameMagicLength - 1) != 0)
+    return NULL;
+
+  /* The trailer repeats the magic, version and all */
+  *version = magic[frameMagicLength - 1];
+  if(*version < 1 || *version > newestFormatVersion
+     || fseek(in, -(long) (2 * sizeof(unsigned long) + frameMagicLength), SEEK_END) != 0
+     || (trailer = ftell(in)) < frameMagicLength
+     || fread(&offset, sizeof(unsigned long), 1, in) != 1
+     || fread(count, sizeof(unsigned long), 1, in) != 1
+     || fread(magic, 1, frameMagicLength, in) != frameMagicLength
+     || memcmp(magic, archiveMagic, frameMagicLength - 1) != 0
+     || magic[frameMagicLength - 1] != *version)
+    return NULL;
+
+  /* The directory lies between the shared table and the trailer,
+     and every entry takes at least its name length and three
+     fields */
+  if(offset < frameMagicLength || offset > (unsigned long) trailer
+     || *count > ((unsigned long) trailer - offset) / directoryEntryMinimum
+     || fseek(in, (long) offset, SEEK_SET) != 0)
+    return NULL;
+
+  members = calloc(*count + 1, sizeof(struct Member));
+  if(members == NULL) return NULL;
 
-  /* Initialize new node's values */
-  newNode->data = data;
-  newNode->frequency = frequency;
-  newNode->left = NULL;
-  newNode->right = NULL;
-  newNode->next = NULL;
+  for(i = 0; i < *count; i++)
+  {
+    if(fread(&nameLength, sizeof(unsigned short), 1, in) != 1)
+      break;
+
+    members[i].name = malloc(nameLength + 1);
+    if(members[i].name == NULL) break;
+    members[i].name[fread(members[i].name, 1, nameLength, in)] = '\0';
 
-  return insertSorted(head, newNode);
+    if(fread(&members[i].offset, sizeof(unsigned long), 1, in) != 1
+       || fread(&members[i].size, sizeof(unsigned long), 1, in) != 1
+       || fread(&members[i].codedSize, sizeof(unsigned long), 1, in) != 1)
+      break;
+  }
+
+  /* Short directory */
+  if(i < *count)
+  {
+    freeDirectory(members, i + 1);
+    return NULL;
+  }
+
+  return members;
 }
 
-/********************************************************************************
- * struct QueueNode* createTreeNode(struct QueueNode* head)
+/*****************************************************************
+ * int dropUnchecked(FILE* out, char* name, unsigned long length)
  *
- * This function is called repeatedly to build the tree from existing nodes in
- * a linked list. It takes the smallest two nodes, combines them with a parent
- * node, and then reinserts the parent node back into the list/tree hybrid
- * pointed to by head. It returns the (possibly new) head.
+ * Takes output that didn't check out back out of the file name,
+ * open as out, when decoding it failed: cuts it to the length
+ * characters of the frames that did check out, or removes it if
+ * none did, or to less if not all of it got written. Output that
+ * isn't a regular file can't be taken back and is left as it is.
+ * Returns 0 if the file couldn't be cut.
  */
-struct QueueNode* createNodeTree(struct QueueNode* head)
+int dropUnchecked(FILE* out, char* name, unsigned long length)
 {
-  /* Make space for new node to insert (root node of two combined nodes) */
-  struct QueueNode* newNode = malloc(sizeof(struct QueueNode));
+  struct stat info;
 
-  /* Make the ndoe to be the new head */
-  struct QueueNode* newHead;
+  fflush(out);
+  if(fstat(fileno(out), &info) != 0 || !S_ISREG(info.st_mode)) return 1;
 
-  /* Initialize values of the new node, change pointers of children */
-  newNode->data = head->next->data;
-  newNode->frequency = (head->frequency) + (head->next->frequency);
-  newNode->left = head;
-  newNode->right = head->next;
-  newNode->next = NULL;
+  /* Never grow the file */
+  if((unsigned long) info.st_size < length) length = info.st_size;
 
-  newHead = head->next->next;
-  head->next->next = NULL;
-  head->next = NULL;
+  if(length == 0) return remove(name) == 0;
+  return ftruncate(fileno(out), (off_t) length) == 0;
+}
 
-  /* Insert new root with children back into queue */
-  return insertSorted(newHead, newNode);
+/*****************************************************************
+ * int archiveMain(int argc, char** argv)
+ *
+ * Handles "--list archive", which prints the archive's members,
+ * and "--extract archive member file", which decodes just that
+ * member into file using the archive's shared table.
+ */
+int archiveMain(int argc, char** argv)
+{
+  int extract = strcmp(argv[1], "--extract") == 0;
+  struct DecodeContext ctx;
+  struct Member* members;
+  unsigned long count, i;
+  FILE* in;
+  FILE* out;
+  int ok, version;
 
+  if(argc != (extract ? 5 : 3))
+  {
+    printf("wrong number of args\n");
+    return 1;
+  }
+
+  /* Open input file, check for errors */
+  in = fopen(argv[2], "rb");
+  if(in == NULL)
+  {
+    printf("couldn't open %s for reading\n", argv[2]);
+    return 2;
+  }
+
+  members = readDirectory(in, &count, &version);
+  if(members == NULL)
+  {
+    printf("%s isn't an archive\n", argv[2]);
+    fclose(in);
+    return 4;
+  }
+
+  if(!extract)
+  {
+    printf("Size\tCoded\tName\n");
+    for(i = 0; i < count; i++)
+      printf("%lu\t%lu\t%s\n", members[i].size, members[i].codedSize, members[i].name);
+
+    freeDirectory(members, count);
+    fclose(in);
+    return 0;
+  }
+
+  for(i = 0; i < count; i++)
+    if(strcmp(members[i].name, argv[3]) == 0) break;
+
+  if(i == count)
+  {
+    printf("%s has no member %s\n", argv[2], argv[3]);
+    freeDirectory(members, count);
+    fclose(in);
+    return 4;
+  }
+
+  /* Open output file, check for errors */
+  out = fopen(argv[4], "wb");
+  if(out == NULL)
+  {
+    printf("couldn't open %s for writing\n", argv[4]);
+    freeDirectory(members, count);
+    fclose(in);
+    return 3;
+  }
+
+  /* The shared table follows the archive magic */
+  fseek(in, frameMagicLength, SEEK_SET);
+  decodeInit(&ctx);
+  decodeSpan(&ctx, readTable(in), members[i].size, version);
+
+  /* Read only the member's own blocks */
+  fseek(in, (long) members[i].offset, SEEK_SET);
+  ok = decode(in, out, &ctx, members[i].codedSize) ? 0 : ferror(out) ? 6 : 4;
+
+  if(ok == 4) printf("%s is truncated or corrupt\n", argv[2]);
+  if(ok == 6) printf("couldn't write all of %s\n", argv[4]);
+  if(ok != 0 && !dropUnchecked(out, argv[4], 0))
+    printf("couldn't remove %s\n", argv[4]);
+
+  freeDirectory(members, count);
+  fclose(in);
+  if(fclose(out) != 0 && ok == 0)
+  {
+    printf("couldn't write all of %s\n", argv[4]);
+    ok = 6;
+  }
+  return ok;
 }
 
-/*******************************************************
- * struct QueueNode* buildTree(struct QueueNode* head)
+/*****************************************************************
+ * void checkBlock(struct TestLane* lane, struct Block* block)
  *
- * This function is a helper function which calls
- * createNodeTree until the Huffman tree is fully
- * built. It creates the tree from the list/tree
- * hybrid pointed to by head, and returns the root
- * of the resulting tree.
+ * Decodes block into lane's scratch space, without writing it
+ * anywhere, and compares the CRC32C of the result with the one its
+ * header gave. Sets the block's bad flag if it doesn't decode or
+ * doesn't match, or claims more than its coded bytes could hold.
  */
-struct QueueNode* buildTree(struct QueueNode* head)
+void checkBlock(struct TestLane* lane, struct Block* block)
 {
-  while(head->next != NULL)
-    head = createNodeTree(head);
+  struct DecodeContext* ctx = lane->ctx;
+  const unsigned char* in = block->data;
+  size_t inLength = block->length, room, n;
+  unsigned char* out;
+  unsigned char* grown;
+  unsigned long left;
+  unsigned int crc = 0;
 
-  return head;
+  block->bad = 0;
+
+  if(block->mode == blockStored) crc = crc32c(0, block->data, block->length);
+
+  /* A single-symbol block is checked a scratch buffer at a time */
+  else if(block->mode == blockSingle)
+  {
+    memset(lane->scratch, block->data[0], lane->scratchSize);
+    for(left = block->rawLength; left > 0; left -= n)
+    {
+      n = left < lane->scratchSize ? left : lane->scratchSize;
+      crc = crc32c(crc, lane->scratch, n);
+    }
+  }
+
+  else
+  {
+    /* Every symbol takes at least a bit */
+    if((block->mode == blockSorted ? block->symbolCount : block->rawLength)
+       > 8 * (unsigned long) block->length)
+    {
+      block->bad = 1;
+      return;
+    }
+
+    /* Each new tree needs its table built again */
+    if(lane->frame != block->frame)
+    {
+      ctx->root = block->root;
+      buildDecodeTable(ctx->table, ctx->root);
+      lane->frame = block->frame;
+    }
+
+    /* Block-sorted symbols are decoded for the unsorter */
+    if(block->mode == blockSorted)
+    {
+      if(!unsorterFit(&ctx->unsorter, block->rawLength, block->symbolCount))
+      {
+	block->bad = 1;
+	return;
+      }
+      out = ctx->unsorter.symbols;
+      room = block->symbolCount;
+    }
+
+    else
+    {
+      if(lane->scratchSize < block->rawLength)
+      {
+	grown = malloc(block->rawLength);
+	if(grown == NULL)
+	{
+	  block->bad = 1;
+	  return;
+	}
+	free(lane->scratch);
+	lane->scratch = grown;
+	lane->scratchSize = block->rawLength;
+      }
+      out = lane->scratch;
+      room = block->rawLength;
+    }
+
+    ctx->current = ctx->root;
+    ctx->blockLeft = room;
+    ctx->codedLeft = block->length;
+    ctx->bitBuffer = 0;
+    ctx->bitCount = 0;
+
+    if(!traverseTree(ctx, &in, &inLength, &out, &room) || ctx->blockLeft > 0
+       || (block->mode == blockSorted
+	   && !unsort(&ctx->unsorter, ctx->unsorter.symbols, block->symbolCount,
+		      block->primary, block->rawLength)))
+    {
+      block->bad = 1;
+      return;
+    }
+
+    if(block->mode == blockSorted) crc = crc32c(0, ctx->unsorter.out, block->rawLength);
+    else crc = crc32c(0, lane->scratch, block->rawLength);
+  }
+
+  /* Format 1 has nothing to compare with */
+  block->bad = block->version > 1 && crc != block->crc;
 }
 
-/***********************************************
- * void freeTree(struct QueueNode* head)
+/*****************************************************************
+ * void* checkerStage(void* arg)
  *
- * This function frees the malloc-ed memory
- * used by the nodes which start at head.
+ * Checker thread for --test. Checks each block the parser deals
+ * to its lane and hands it back, until the end marker.
  */
-void freeTree(struct QueueNode* head)
+void* checkerStage(void* arg)
 {
-  if(head != NULL)
+  struct TestLane* lane = arg;
+  struct Block* block;
+
+  while(!(block = ringPop(&lane->toChecker))->last)
   {
-    freeTree(head->left);
-    freeTree(head->right);
-    free(head);
+    checkBlock(lane, block);
+    ringPush(&lane->toParser, block);
   }
+
+  return NULL;
 }
 
-/****************************************************************
- * void traverseTree(struct QueueNode* head, FILE* in, FILE* out)
+/*****************************************************************
+ * struct Block* collectBlock(struct Tester* t, struct Block* block)
  *
- * The function traverses the existing Huffman tree pointed to
- * by head. It reads in bytes from the file pointed to at in
- * and when a node is reached by going left (bit is 0) or right
- * (bit is 1), writes that character to the file pointed to by
- * out.
+ * Takes back a block the checker is done with, reporting it if it
+ * was corrupt and counting it as checked if not. Returns block,
+ * ready to reuse.
  */
-void traverseTree(struct QueueNode* head, FILE* in, FILE* out)
+struct Block* collectBlock(struct Tester* t, struct Block* block)
 {
-  unsigned char rawInput;
-  int bytes[8];
-  struct QueueNode* current = head;
-  int i = 0;
-  int charCount = 0;
+  if(block->bad)
+  {
+    printf("%s: block %lu is corrupt\n", t->name, block->seq);
+    t->badBlocks++;
+  }
 
-  while(fread(&rawInput, sizeof(unsigned char), 1, in) == 1
-	&& charCount < totalChars)
+  else
   {
-    for(i = 0; i < 8; i++)
+    t->blocks++;
+    t->bytes += block->rawLength;
+  }
+  return block;
+}
+
+/*****************************************************************
+ * struct Block* takeBlock(struct Tester* t, struct TestLane** lane)
+ *
+ * Picks the next lane in turn, setting *lane to it, and returns a
+ * block of that lane's to fill, waiting for its checker to hand
+ * one back if need be.
+ */
+struct Block* takeBlock(struct Tester* t, struct TestLane** lane)
+{
+  *lane = &t->lanes[t->next++ % t->laneCount];
+
+  if((*lane)->spareCount > 0) return (*lane)->spare[--(*lane)->spareCount];
+  return collectBlock(t, ringPop(&(*lane)->toParser));
+}
+
+/*****************************************************************
+ * void waitForCheckers(struct Tester* t)
+ *
+ * Waits until every lane's checker has handed back all its blocks,
+ * so the tree they were checked with can be freed.
+ */
+void waitForCheckers(struct Tester* t)
+{
+  struct TestLane* lane;
+  int i;
+
+  for(i = 0; i < t->laneCount; i++)
+  {
+    lane = &t->lanes[i];
+    while(lane->spareCount < ringSize)
+      lane->spare[lane->spareCount++] = collectBlock(t, ringPop(&lane->toParser));
+  }
+}
+
+/*****************************************************************
+ * int testBlocks(struct Tester* t, FILE* in, struct QueueNode* root,
+ *                int version, unsigned long total)
+ *
+ * Reads the blocks of one frame or archive member from in, total
+ * characters coded with the tree at root, and deals them to the
+ * checkers. Checks the frame's own CRC32C, over the blocks' CRC32Cs,
+ * as it goes. Returns 0 if the blocks don't fit together, which
+ * the checkers can't find.
+ */
+int testBlocks(struct Tester* t, FILE* in, struct QueueNode* root, int version, unsigned long total)
+{
+  struct TestLane* lane;
+  struct Block* block;
+  unsigned char mode;
+  unsigned long length, count = 0, payload, primary = 0, symbolCount = 0;
+  unsigned int crc = 0, streamCrc = 0, expected;
+
+  while(count < total)
+  {
+    if(fread(&mode, sizeof(unsigned char), 1, in) != 1
+       || fread(&length, sizeof(unsigned long), 1, in) != 1
+       || (version > 1 && fread(&crc, sizeof(unsigned int), 1, in) != 1)
+       || length == 0 || length > total - count)
+      return 0;
+
+    /* A tree that's only a leaf codes nothing */
+    if(mode == blockHuffman && root != NULL && root->left != NULL)
     {
-      bytes[i] = rawInput % 2;
-      rawInput /= 2;
+      if(fread(&payload, sizeof(unsigned long), 1, in) != 1) return 0;
     }
 
-    for(i = 0; i < 8; i++)
+    else if(mode == blockSorted && version > 2 && root != NULL && root->left != NULL)
     {
-      if(bytes[i] == 1 && current->right != NULL)
-	current = current->right;
+      if(fread(&primary, sizeof(unsigned long), 1, in) != 1
+	 || fread(&symbolCount, sizeof(unsigned long), 1, in) != 1
+	 || fread(&payload, sizeof(unsigned long), 1, in) != 1
+	 || length > maxSortedLength || symbolCount == 0 || symbolCount > 2 * length)
+	return 0;
+    }
 
-      else if(bytes[i] == 0 && current->left != NULL)
-	current = current->left;
+    else if(mode == blockStored) payload = length;
+    else if(mode == blockSingle) payload = 1;
+    else return 0;
+
+    if(payload > t->size - (unsigned long) ftell(in)) return 0;
+
+    block = takeBlock(t, &lane);
+    if(block->capacity < payload)
+    {
+      free(block->data);
+      block->capacity = payload;
+      block->data = malloc(block->capacity);
+    }
+
+    block->length = fread(block->data, 1, payload, in);
+    if(block->length < payload)
+    {
+      lane->spare[lane->spareCount++] = block;
+      return 0;
+    }
+
+    block->mode = mode;
+    block->rawLength = length;
+    block->crc = crc;
+    block->seq = t->seq++;
+    block->version = version;
+    block->root = root;
+    block->frame = t->frame;
+    block->primary = primary;
+    block->symbolCount = symbolCount;
+    ringPush(&lane->toChecker, block);
+
+    streamCrc = crc32c(streamCrc, (unsigned char*) &crc, sizeof(unsigned int));
+    count += length;
+  }
+
+  if(version > 1
+     && (fread(&expected, sizeof(unsigned int), 1, in) != 1 || expected != streamCrc))
+    return 0;
+
+  return 1;
+}
+
+/*****************************************************************
+ * int testFile(struct Tester* t, char* name)
+ *
+ * Checks every frame of the encoded file called name, or every
+ * member if it's an archive, and prints how it went. Returns 1 if
+ * all of it decodes and matches its checksums.
+ */
+int testFile(struct Tester* t, char* name)
+{
+  unsigned char magic[frameMagicLength];
+  struct Member* members;
+  struct QueueNode* root;
+  unsigned long count, total, i, frames = 0;
+  int version, ok = 1, checksums = 1;
+  size_t length;
+  FILE* in;
 
-      if(current->left == NULL && current->right == NULL && charCount < totalChars)
+  /* Open input file, check for errors */
+  in = fopen(name, "rb");
+  if(in == NULL)
+  {
+    printf("couldn't open %s for reading\n", name);
+    return 0;
+  }
+
+  fseek(in, 0, SEEK_END);
+  t->size = ftell(in);
+  rewind(in);
+  t->name = name;
+  t->seq = 0;
+  t->badBlocks = 0;
+
+  length = fread(magic, 1, frameMagicLength, in);
+  rewind(in);
+
+  /* An archive's members all share the table after its magic */
+  if(length == frameMagicLength && memcmp(magic, archiveMagic, frameMagicLength - 1) == 0)
+  {
+    members = readDirectory(in, &count, &version);
+    if(members == NULL) ok = 0;
+    else
+    {
+      fseek(in, frameMagicLength, SEEK_SET);
+      root = readTable(in);
+      t->frame++;
+
+      for(i = 0; i < count && ok; i++)
+	ok = fseek(in, (long) members[i].offset, SEEK_SET) == 0
+	  && testBlocks(t, in, root, version, members[i].size)
+	  && (unsigned long) ftell(in) == members[i].offset + members[i].codedSize;
+
+      waitForCheckers(t);
+      freeTree(root);
+      freeDirectory(members, count);
+      checksums = version > 1;
+    }
+  }
+
+  /* Otherwise frames back to back, each with its own table */
+  else
+  {
+    while(ok && (length = fread(magic, 1, frameMagicLength, in)) == frameMagicLength)
+    {
+      version = magic[frameMagicLength - 1];
+      if(memcmp(magic, frameMagic, frameMagicLength - 1) != 0
+	 || version < 1 || version > newestFormatVersion)
       {
-	char toWrite = current->data;
-	fwrite(&toWrite, sizeof(char), 1, out);
-	charCount++;
-	current = head;
+	ok = 0;
+	break;
       }
+
+      root = readTable(in);
+      t->frame++;
+      ok = fread(&total, sizeof(unsigned long), 1, in) == 1
+	&& testBlocks(t, in, root, version, total);
+
+      waitForCheckers(t);
+      freeTree(root);
+      frames++;
+      if(version == 1) checksums = 0;
     }
+
+    ok = ok && length == 0 && frames > 0;
+  }
+
+  fclose(in);
+
+  if(!ok) printf("%s is truncated or corrupt\n", name);
+  else if(t->badBlocks > 0) printf("%s: %lu of %lu blocks corrupt\n", name, t->badBlocks, t->seq);
+  else if(!checksums) printf("%s: decodes, but has no checksums\n", name);
+  else printf("%s: ok\n", name);
+
+  return ok && t->badBlocks == 0;
+}
+
+/*****************************************************************
+ * int testMain(int argc, char** argv)
+ *
+ * Handles "--test [-t threads] file ...", which checks each encoded
+ * file or archive decodes and matches its checksums without writing
+ * anything. This thread reads the blocks in order and deals them to
+ * that many checker threads, each decoding with its own table.
+ */
+int testMain(int argc, char** argv)
+{
+  struct Tester t;
+  struct TestLane* lane;
+  struct Block* block;
+  int first = 2, failed = 0, i, j;
+
+  t.laneCount = 1;
+  if(argc > 3 && strcmp(argv[2], "-t") == 0)
+  {
+    t.laneCount = atoi(argv[3]);
+    if(t.laneCount < 1 || t.laneCount > maxLanes)
+    {
+      printf("thread count must be 1 to %d\n", maxLanes);
+      return 1;
+    }
+    first = 4;
+  }
+
+  if(argc <= first)
+  {
+    printf("wrong number of args\n");
+    return 1;
+  }
+
+  t.lanes = calloc(t.laneCount, sizeof(struct TestLane));
+  t.next = 0;
+  t.frame = 0;
+  t.blocks = 0;
+  t.bytes = 0;
+
+  for(i = 0; i < t.laneCount; i++)
+  {
+    lane = &t.lanes[i];
+    lane->ctx = malloc(sizeof(struct DecodeContext));
+    decodeInit(lane->ctx);
+    ringInit(&lane->toChecker);
+    ringInit(&lane->toParser);
+    lane->scratchSize = blockSize;
+    lane->scratch = malloc(lane->scratchSize);
+
+    for(j = 0; j < ringSize; j++)
+      lane->spare[lane->spareCount++] = &lane->blocks[j];
+
+    pthread_create(&lane->thread, NULL, checkerStage, lane);
   }
+
+  for(i = first; i < argc; i++)
+    if(!testFile(&t, argv[i])) failed++;
+
+  /* Every checker gets an end marker */
+  for(i = 0; i < t.laneCount; i++)
+  {
+    block = takeBlock(&t, &lane);
+    block->last = 1;
+    ringPush(&lane->toChecker, block);
+  }
+
+  for(i = 0; i < t.laneCount; i++)
+  {
+    lane = &t.lanes[i];
+    pthread_join(lane->thread, NULL);
+
+    for(j = 0; j < ringSize; j++)
+      free(lane->blocks[j].data);
+    free(lane->scratch);
+    unsorterFree(&lane->ctx->unsorter);
+    free(lane->ctx);
+    ringFree(&lane->toChecker);
+    ringFree(&lane->toParser);
+  }
+  free(t.lanes);
+
+  printf("%d of %d files failed, %lu blocks and %lu bytes checked\n",
+	 failed, argc - first, t.blocks, t.bytes);
+  return failed ? 4 : 0;
 }
 
 int main(int argc, char** argv)
@@ -238,8 +1014,18 @@ int main(int argc, char** argv)
   char* outfile;
   FILE* in;
   FILE* out;
+  struct DecodeContext ctx;
+  int written;
 
-  struct QueueNode* head = NULL;
+  crcInit();
+
+  /* Archives are read by member instead */
+  if(argc > 1 && (strcmp(argv[1], "--list") == 0 || strcmp(argv[1], "--extract") == 0))
+    return archiveMain(argc, argv);
+
+  /* "--test" checks files without writing anything */
+  if(argc > 1 && strcmp(argv[1], "--test") == 0)
+    return testMain(argc, argv);
 
   /* Check for valid amount of args */
   if(argc != 3)
@@ -267,37 +1053,29 @@ int main(int argc, char** argv)
     return 3;
   }
 
-  /* Read the number of unique symbols number from the file */
-  fread(&numSymbols, sizeof(unsigned short), 1, in);
-
-  /* Read until we have correct amount of symbols and their
-     frequencies */
-  while(numSymbols)
+  /* Decode the file, header and all */
+  decodeInit(&ctx);
+  if(!decode(in, out, &ctx, (unsigned long) -1))
   {
-    int data, frequency;
-
-    fread(&data, sizeof(unsigned char), 1, in);
-    fread(&frequency, sizeof(unsigned long), 1, in);
-
-    /* Build up the linked list as we go with the stored values */
-    head = createNodeLinked(head, data, frequency);
-
-    numSymbols--;
+    written = !ferror(out);
+    if(written) printf("%s is truncated or corrupt\n", infile);
+    else printf("couldn't write all of %s\n", outfile);
+    if(!dropUnchecked(out, outfile, ctx.checkedChars))
+      printf("couldn't take the unchecked output back out of %s\n", outfile);
+    else if(written && ctx.checkedChars > 0)
+      printf("kept the %lu bytes of whole frames that checked out\n", ctx.checkedChars);
+    fclose(in);
+    fclose(out);
+    return written ? 4 : 6;
   }
 
-  /* Read the total number of characters number from the file */
-  fread(&totalChars, sizeof(unsigned long), 1, in);
-
-  /* Build the Huffman tree from the existing linked list */
-  head = buildTree(head);
-
-  /* Decode the file by traversing the Huffman tree */
-  traverseTree(head, in, out);
-
   /* Clean up */
-  freeTree(head);
   fclose(in);
-  fclose(out);
+  if(fclose(out) != 0)
+  {
+    printf("couldn't write all of %s\n", outfile);
+    return 6;
+  }
 
   return 0;
 
@@ -11,128 +11,671 @@
 /* The program expects two command line arguments. The      */
 /* first is the file to be encoded. The second is the file  */
 /* to be created which will contain the encoded data        */
+/* They may be preceded by "-t N" to code with N threads,   */
+/* "-s P" to build the table from a P% sample, "-1" to "-9" */
+/* to trade speed for size, "--stats" to report settings    */
+/* and sizes, "--verify" to decode each block back as it's  */
+/* written, and "--append" to add the input as a new frame  */
+/* to the end of an existing encoded file.                  */
+/* With "--dry-run" it instead takes any number of files or */
+/* directories and only reports the size encoding each      */
+/* would give, and its entropy. With "--archive" the first  */
+/* name is an archive to create from the files and          */
+/* directories named after it.                              */
 /* It returns errors for invalid argument number, problems  */
 /* opening or closing files, etc.                           */
 /************************************************************/
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "huffman.h"
+
+/* Longest code that is packed into a single word for the coding stages */
+#define maxPackedLength 24
+
+/* Level used when none is given; the same as before there were levels */
+#define defaultLevel 6
+
+/* Most coding stages the pipeline will run */
+#define maxLanes 64
 
-/* Max tree depth and therefore max code length */
-#define maxHeight 127
+/* Format version written; block-sorted frames get their own, since
+   older decoders can't read them */
+#define formatVersion 2
+#define sortedFormatVersion 3
+
+/* Bytes in each block when block sorting, which pays more the more
+   it sees at once; the longest block the decoder takes */
+#define sortedBlockSize maxSortedLength
+
+/* Percent of the input block sorting builds its table from unless
+   told otherwise, since counting it all sorts every block twice */
+#define sortedSamplePercent 10
 
 /* Holds character frequencies of characters in the input stream */
-int frequencyMap[256] = {0};
+unsigned long frequencyMap[256] = {0};
 
 /* Structure to hold Huffman codes */
 int huffmanValues[256][maxHeight];
 
-/* Does-it-all Node */
-struct QueueNode
+/* Huffman codes packed for the coding stages, and their lengths */
+unsigned long codeWord[256];
+int codeLength[256];
+
+/* How many blocks were written each way, indexed by block mode */
+unsigned long blockCounts[4];
+
+/* Set to Burrows-Wheeler transform every block before coding it */
+int blockSorting = 0;
+
+/* Bytes of input read and coded as one unit by the pipeline */
+size_t blockSize = 256 * 1024;
+
+/* No code may be longer than this */
+int maxCodeLength = maxHeight;
+
+/* Settings behind each compression level */
+struct Level
+{
+  /* Bytes in each block */
+  size_t blockSize;
+
+  /* Percent of the input the table is built from; 0 counts it all */
+  double samplePercent;
+
+  /* Longest code allowed */
+  int maxCodeLength;
+
+  /* Set to block-sort every block, as --bwt does */
+  int blockSorting;
+};
+
+/* Levels -1 (fastest) to -9 (smallest). Low levels sample the input
+   instead of reading it twice and keep codes short enough for the
+   decoder's table; -6 uses exact counts and unlimited codes, which is
+   as small as one table gets. Only block sorting goes smaller than
+   that, so -7 to -9 block-sort, with the table from a bigger sample
+   each level up until -9 counts exactly, sorting every block twice. */
+struct Level levels[10] =
+{
+  {0, 0, 0, 0},
+  {1024 * 1024, 1, decodeTableBits, 0},
+  {1024 * 1024, 2, decodeTableBits, 0},
+  {512 * 1024, 5, decodeTableBits, 0},
+  {512 * 1024, 0, decodeTableBits, 0},
+  {256 * 1024, 0, 15, 0},
+  {256 * 1024, 0, maxHeight, 0},
+  {sortedBlockSize, 2, maxHeight, 1},
+  {sortedBlockSize, sortedSamplePercent, maxHeight, 1},
+  {sortedBlockSize, 0, maxHeight, 1}
+};
+
+/* A buffer of input and its coded output, recycled through the pipeline */
+struct Block
+{
+  /* Raw input bytes and how many are used */
+  unsigned char* data;
+  size_t length;
+
+  /* How the block is written out: blockHuffman, blockStored,
+     blockSingle or blockSorted */
+  int mode;
+
+  /* When block sorting, the symbols coded in place of the input,
+     and the row of the sorted rotations the input ended up in */
+  unsigned char* sorted;
+  size_t sortedLength;
+  unsigned long primary;
+
+  /* Huffman coded output, padded to a whole byte */
+  unsigned char* coded;
+  size_t codedBytes;
+
+  /* Counts of each symbol coded */
+  unsigned long histogram[256];
+
+  /* CRC32C of the input bytes */
+  unsigned int crc;
+
+  /* Position of the block in the input, counting from 0 */
+  unsigned long seq;
+
+  /* Set on the empty block that marks the end of the input */
+  int last;
+};
+
+/* What the coding stages count while coding with a sampled table,
+   to cost the table counting all the input would have given */
+struct ExactCount
+{
+  /* Every symbol counting all the input would have seen */
+  unsigned long symbols[256];
+
+  /* The symbols of just the blocks that were Huffman coded, and the
+     bytes of those that were stored as they were */
+  unsigned long coded[256];
+  unsigned long storedBytes;
+};
+
+/* One coding stage with its own blocks and the rings around it */
+struct Lane
+{
+  /* Reader to coder, coder to writer, and writer back to reader,
+     by way of the verifier when verifying */
+  struct BlockRing toCoder;
+  struct BlockRing toWriter;
+  struct BlockRing toVerifier;
+  struct BlockRing toReader;
+
+  struct Block blocks[ringSize];
+  pthread_t thread;
+  pthread_t verifier;
+
+  /* Where the verifier undoes sorted blocks */
+  struct Unsorter unsorter;
+
+  /* The pipeline the lane belongs to */
+  struct Pipeline* pipe;
+
+  /* Exact counts of the bytes coded, kept when the table was sampled */
+  int countBytes;
+  struct ExactCount counted;
+};
+
+/* Everything the stages of one encode share */
+struct Pipeline
 {
-  /* The ASCII character*/
-  int data;
+  FILE* in;
+  FILE* out;
+
+  /* Bytes the reader may still take from in, as many as were
+     counted into the table and the frame's total */
+  unsigned long inputLeft;
+
+  /* Blocks are dealt to the lanes round-robin, in input order */
+  struct Lane* lanes;
+  int laneCount;
+
+  /* Total bytes the writer produced */
+  unsigned long writtenBytes;
+
+  /* Set if any write to out came up short */
+  int writeFailed;
+
+  /* CRC32C over every block's CRC32C, in order */
+  unsigned int streamCrc;
+
+  /* Tree to decode each written block with, or NULL not to verify */
+  struct QueueNode* verifyTree;
+
+  /* Blocks that didn't decode back to their input, and the first */
+  unsigned long badBlocks;
+  unsigned long firstBadBlock;
+};
+
+/* Tree encode decodes written blocks back with, when verifying */
+struct QueueNode* verifyTree = NULL;
 
-  /* The character's frequency */
-  int frequency;
+/* Blocks that failed verification, and the first one */
+unsigned long badBlocks;
+unsigned long firstBadBlock;
 
-  /* Left child of current node */
-  struct QueueNode* left;
+/* Set once a write of coded blocks to the output fails */
+int writeFailed = 0;
 
-  /* Right child of current node */
-  struct QueueNode* right;
+/* Steps through verifyTree for every next decodeTableBits bits */
+struct TableEntry decodeTable[1 << decodeTableBits];
 
-  /* Next node in list */
-  struct QueueNode* next;
+/* Input counted on several threads at once, each block-sorting
+   the next block it takes */
+struct CountList
+{
+  FILE* in;
+  pthread_mutex_t lock;
+
+  /* Bytes taken so far */
+  unsigned long total;
+};
+
+/* One of those threads, and what it counted */
+struct Counter
+{
+  struct CountList* list;
+  unsigned long histogram[256];
+  pthread_t thread;
 };
 
-struct bitNode
+/* Files for a dry run, shared by its worker threads */
+struct FileList
 {
-  /* The particular bit (1 or 0) */
-  int bit;
+  char** paths;
+  unsigned long count;
+  unsigned long capacity;
 
-  /* The next bit */
-  struct bitNode* nextBit;
+  /* Next file for a worker to claim, and what each worker found */
+  unsigned long next;
+  struct Analysis* results;
+
+  /* Percent of each file the table would be sampled from, or 0 */
+  double samplePercent;
 };
 
-/* Scans the "file" (stdin), adds occurrances to frequencyMap */
-void countFrequencies(FILE* in)
+/*****************************************************************
+ * void suffixBuckets(const int* text, int n, int* buckets,
+ *                    int alphabet, int ends)
+ *
+ * Sets buckets[c] to where the suffixes of text starting with c
+ * begin in its suffix array, or to just past where they end if
+ * ends is set.
+ */
+void suffixBuckets(const int* text, int n, int* buckets, int alphabet, int ends)
 {
-  /* char c */
-  int c;
+  int i, sum = 0;
+
+  for(i = 0; i < alphabet; i++)
+    buckets[i] = 0;
+  for(i = 0; i < n; i++)
+    buckets[text[i]]++;
 
-  /* While not EOF, get next character, add to frequencyMap */
-  while((c = getc(in)) != EOF)
+  for(i = 0; i < alphabet; i++)
   {
-    if(c > 256 || c < 0) printf("What is this?? %d=%c\n", c, c);
-    else frequencyMap[c]++;
+    sum += buckets[i];
+    buckets[i] = ends ? sum : sum - buckets[i];
   }
 }
 
-/************************************************************************************
- * struct QueueNode* insertSorted(struct QueueNode* head, struct QueueNode* newNode)
+/*****************************************************************
+ * void induceSuffixes(const int* text, const unsigned char* smaller,
+ *                     int* suffixes, int n, int* buckets, int alphabet)
  *
- * The function takes a new node, newNode, and inserts it into the correct position
- * in the existing linked list, starting at head. Returns the (maybe new) head.
+ * From the suffixes already placed, places every L-type suffix
+ * (bigger than the one after it) in a pass from the left, then
+ * every S-type suffix (smaller) in a pass from the right. smaller
+ * gives each position's type.
  */
-struct QueueNode* insertSorted(struct QueueNode* head, struct QueueNode* newNode)
+void induceSuffixes(const int* text, const unsigned char* smaller,
+		    int* suffixes, int n, int* buckets, int alphabet)
 {
-  struct QueueNode* current = head;
+  int i, j;
+
+  suffixBuckets(text, n, buckets, alphabet, 0);
+  for(i = 0; i < n; i++)
+  {
+    j = suffixes[i] - 1;
+    if(suffixes[i] > 0 && !smaller[j]) suffixes[buckets[text[j]]++] = j;
+  }
+
+  suffixBuckets(text, n, buckets, alphabet, 1);
+  for(i = n - 1; i >= 0; i--)
+  {
+    j = suffixes[i] - 1;
+    if(suffixes[i] > 0 && smaller[j]) suffixes[--buckets[text[j]]] = j;
+  }
+}
+
+/*****************************************************************
+ * int isLeftmostS(const unsigned char* smaller, int i)
+ *
+ * Whether position i starts an S-type run after an L-type one,
+ * going by the types in smaller.
+ */
+int isLeftmostS(const unsigned char* smaller, int i)
+{
+  return i > 0 && smaller[i] && !smaller[i - 1];
+}
+
+/*****************************************************************
+ * void suffixArray(int* text, int* suffixes, int n, int alphabet)
+ *
+ * Fills suffixes with the start of every suffix of the n symbols
+ * of text, in sorted order, in time linear in n (SA-IS, Nong, Zhang
+ * and Chan). Symbols are 0 to alphabet - 1, and the last must be a
+ * 0 found nowhere else. The leftmost S-type suffixes of each run
+ * (LMS) are sorted by induction, named by rank, and if any names
+ * repeat, sorted by sorting the shorter text of names the same way;
+ * every other suffix is then induced from them.
+ */
+void suffixArray(int* text, int* suffixes, int n, int alphabet)
+{
+  unsigned char* smaller = malloc(n);
+  int* buckets = malloc(alphabet * sizeof(int));
+  int* names;
+  int i, j, d, count = 0, name = 0, previous = -1, position, differ;
+
+  /* Each suffix's type, from the end; the lone 0 is S-type and
+     everything sorts above it */
+  smaller[n - 1] = 1;
+  if(n > 1) smaller[n - 2] = 0;
+  for(i = n - 3; i >= 0; i--)
+    smaller[i] = text[i] < text[i + 1] || (text[i] == text[i + 1] && smaller[i + 1]);
+
+  /* Sort the LMS substrings, by inducing from their starts placed
+     at the ends of their buckets */
+  suffixBuckets(text, n, buckets, alphabet, 1);
+  for(i = 0; i < n; i++)
+    suffixes[i] = -1;
+  for(i = 1; i < n; i++)
+    if(isLeftmostS(smaller, i)) suffixes[--buckets[text[i]]] = i;
+  induceSuffixes(text, smaller, suffixes, n, buckets, alphabet);
+
+  /* Gather them at the front in their sorted order */
+  for(i = 0; i < n; i++)
+    if(isLeftmostS(smaller, suffixes[i])) suffixes[count++] = suffixes[i];
 
-  /* If the list-tree is empty or the new node's frequency is less than
-     the smallest (head) node's frequency, add it there */
-  if(head == NULL || newNode->frequency < head->frequency)
+  /* Name each by its rank, equal substrings alike, keeping the
+     names in text order at the back */
+  for(i = count; i < n; i++)
+    suffixes[i] = -1;
+  for(i = 0; i < count; i++)
   {
-    newNode->next = current;
-    return newNode;
+    position = suffixes[i];
+    differ = 0;
+
+    for(d = 0; d < n; d++)
+      if(previous == -1 || text[position + d] != text[previous + d]
+	 || smaller[position + d] != smaller[previous + d])
+      {
+	differ = 1;
+	break;
+      }
+      else if(d > 0 && (isLeftmostS(smaller, position + d) || isLeftmostS(smaller, previous + d)))
+	break;
+
+    if(differ)
+    {
+      name++;
+      previous = position;
+    }
+    suffixes[count + position / 2] = name - 1;
   }
 
-  /* Keep checking that there is another node after current node and next node
-     freq is less than new node's freq, then put the new node at the current
-     position (where either of these are untrue: end of list or
-     new node < existing node) */
+  for(i = n - 1, j = n - 1; i >= count; i--)
+    if(suffixes[i] >= 0) suffixes[j--] = suffixes[i];
 
+  /* Order the LMS suffixes, recursing while names repeat */
+  names = suffixes + n - count;
+  if(name < count) suffixArray(names, suffixes, count, name);
   else
+    for(i = 0; i < count; i++)
+      suffixes[names[i]] = i;
+
+  /* Put them at the ends of their buckets in that order, then
+     induce the rest from them */
+  for(i = 1, j = 0; i < n; i++)
+    if(isLeftmostS(smaller, i)) names[j++] = i;
+  for(i = 0; i < count; i++)
+    suffixes[i] = names[suffixes[i]];
+  for(i = count; i < n; i++)
+    suffixes[i] = -1;
+
+  suffixBuckets(text, n, buckets, alphabet, 1);
+  for(i = count - 1; i >= 0; i--)
+  {
+    j = suffixes[i];
+    suffixes[i] = -1;
+    suffixes[--buckets[text[j]]] = j;
+  }
+  induceSuffixes(text, smaller, suffixes, n, buckets, alphabet);
+
+  free(smaller);
+  free(buckets);
+}
+
+/*****************************************************************
+ * size_t putRun(unsigned char* out, size_t count, unsigned long run)
+ *
+ * Writes a run of run zero ranks after the count symbols at out,
+ * as a bijective base 2 number, lowest digit first, with runA for
+ * a 1 and runB for a 2. Returns the new number of symbols.
+ */
+size_t putRun(unsigned char* out, size_t count, unsigned long run)
+{
+  while(run > 0)
+  {
+    run--;
+    out[count++] = run & 1 ? runB : runA;
+    run >>= 1;
+  }
+
+  return count;
+}
+
+/*****************************************************************
+ * size_t sortSymbols(const unsigned char* data, size_t length,
+ *                    unsigned char* out, unsigned long* primary)
+ *
+ * Block-sorts the length bytes at data into symbols at out, which
+ * needs room for 2 * length of them. The Burrows-Wheeler transform
+ * groups bytes by what follows them, move-to-front turns repeats
+ * into runs of rank 0, and putRun writes those runs. Ranks 1 to 253
+ * are written one higher, and 254 and 255 as rankEscape then 0 or
+ * 1. Sets *primary to the row of the sorted rotations the input
+ * itself ended up in. Returns the number of symbols, or 0 if data
+ * is one repeated byte, which is sent as a single-symbol block.
+ */
+size_t sortSymbols(const unsigned char* data, size_t length, unsigned char* out, unsigned long* primary)
+{
+  unsigned char order[256], c;
+  unsigned long run = 0;
+  size_t i, count = 0;
+  int* text;
+  int* suffixes;
+  int rank;
+
+  for(i = 1; i < length && data[i] == data[0]; i++)
+    ;
+  if(i >= length) return 0;
+
+  /* Bytes go up by one so 0 can end the text, below all of them */
+  text = malloc((length + 1) * sizeof(int));
+  suffixes = malloc((length + 1) * sizeof(int));
+  for(i = 0; i < length; i++)
+    text[i] = data[i] + 1;
+  text[length] = 0;
+  suffixArray(text, suffixes, length + 1, 257);
+  free(text);
+
+  for(i = 0; i < 256; i++)
+    order[i] = i;
+
+  /* Each row's last column is the byte before its suffix */
+  for(i = 0; i <= length; i++)
+  {
+    if(suffixes[i] == 0)
+    {
+      *primary = i;
+      continue;
+    }
+
+    c = data[suffixes[i] - 1];
+    for(rank = 0; order[rank] != c; rank++)
+      ;
+    memmove(order + 1, order, rank);
+    order[0] = c;
+
+    if(rank == 0)
+    {
+      run++;
+      continue;
+    }
+
+    count = putRun(out, count, run);
+    run = 0;
+
+    if(rank < rankEscape - 1) out[count++] = rank + 1;
+    else
+    {
+      out[count++] = rankEscape;
+      out[count++] = rank - (rankEscape - 1);
+    }
+  }
+
+  free(suffixes);
+  return putRun(out, count, run);
+}
+
+/*****************************************************************
+ * void countSymbols(unsigned char* data, size_t length,
+ *                   unsigned char* sorted, unsigned long freq[])
+ *
+ * Adds the symbols the length bytes at data will be coded as to
+ * freq: the bytes themselves, or when sorted isn't NULL, the
+ * symbols sortSymbols turns them into there.
+ */
+void countSymbols(unsigned char* data, size_t length, unsigned char* sorted,
+		  unsigned long freq[])
+{
+  unsigned long primary;
+  size_t i;
+
+  if(sorted != NULL)
+  {
+    length = sortSymbols(data, length, sorted, &primary);
+    data = sorted;
+  }
+
+  for(i = 0; i < length; i++)
+    freq[data[i]]++;
+}
+
+/*****************************************************************
+ * void* countWorker(void* arg)
+ *
+ * Counting thread. Takes the next block of the shared input and
+ * counts the symbols it block-sorts into, until the input ends.
+ */
+void* countWorker(void* arg)
+{
+  struct Counter* counter = arg;
+  struct CountList* list = counter->list;
+  unsigned char* buffer = malloc(blockSize);
+  unsigned char* sorted = malloc(2 * blockSize);
+  size_t length;
+
+  do
   {
-    /* Comparing unequal frequencies */
-    while(current->next != NULL && current->next->frequency < newNode->frequency)
-      current = current->next;
+    pthread_mutex_lock(&list->lock);
+    length = fread(buffer, 1, blockSize, list->in);
+    list->total += length;
+    pthread_mutex_unlock(&list->lock);
 
-    if(head->frequency == newNode->frequency && head->data > newNode->data)
+    countSymbols(buffer, length, sorted, counter->histogram);
+  } while(length > 0);
+
+  free(buffer);
+  free(sorted);
+  return NULL;
+}
+
+/* Scans the "file" (stdin), adds occurrances to frequencyMap.
+   Block sorting every block is slow, so then lanes threads share
+   the work. Returns how many bytes it read. */
+unsigned long countFrequencies(FILE* in, int lanes)
+{
+  unsigned char* buffer;
+  unsigned char* sorted;
+  struct CountList list;
+  struct Counter* counters;
+  unsigned long total = 0;
+  size_t length;
+  int i, c;
+
+  if(blockSorting && lanes > 1)
+  {
+    list.in = in;
+    list.total = 0;
+    pthread_mutex_init(&list.lock, NULL);
+    counters = calloc(lanes, sizeof(struct Counter));
+
+    for(i = 0; i < lanes; i++)
+    {
+      counters[i].list = &list;
+      pthread_create(&counters[i].thread, NULL, countWorker, &counters[i]);
+    }
+
+    for(i = 0; i < lanes; i++)
     {
-      newNode->next = current;
-      return newNode;
+      pthread_join(counters[i].thread, NULL);
+      for(c = 0; c < 256; c++)
+	frequencyMap[c] += counters[i].histogram[c];
     }
 
-    /* Comparing unequal data (ASCII) values with equal frequency values */
-    while(current->next != NULL && current->next->frequency == newNode->frequency &&
-	  current->next->data < newNode->data)
-      current = current->next;
+    free(counters);
+    pthread_mutex_destroy(&list.lock);
+    return list.total;
+  }
+
+  buffer = malloc(blockSize);
+  sorted = blockSorting ? malloc(2 * blockSize) : NULL;
+
+  /* While not EOF, get next block of characters, add to frequencyMap */
+  while((length = fread(buffer, 1, blockSize, in)) > 0)
+  {
+    countSymbols(buffer, length, sorted, frequencyMap);
+    total += length;
   }
-  newNode->next = current->next;
-  current->next = newNode;
-  return head;
+
+  free(buffer);
+  free(sorted);
+  return total;
 }
-/**************************************************************************************
- * struct QueueNode* createNodeLinked(struct QueueNode* head, int data, int frequency)
+
+/******************************************************************
+ * unsigned long sampleFrequencies(FILE* in, double percent, int lanes)
  *
- * Creates a node with given data, data, and frequency, frequency, and inserts it
- * in the correct location. Returns the head.
+ * Fills frequencyMap from about percent % of the input stream, in,
+ * read as sampleChunk sized pieces spread evenly over the file,
+ * each block-sorted on its own if block sorting. Every symbol is
+ * then given a count of at least one, so bytes the sample missed
+ * still get a code. If that would read the whole input it's counted
+ * on lanes threads instead, as countFrequencies does. Returns the
+ * size of the input, or 0 if in can't be seeked, in which case
+ * nothing was counted.
  */
-struct QueueNode* createNodeLinked(struct QueueNode* head, int data, int frequency)
+unsigned long sampleFrequencies(FILE* in, double percent, int lanes)
 {
-  /* Make space for new node to insert */
-  struct QueueNode* newNode = malloc(sizeof(struct QueueNode));
+  unsigned char* buffer;
+  unsigned char* sorted;
+  unsigned long size, chunks, stride, k;
+  size_t length, i;
+  long end;
+
+  if(fseek(in, 0, SEEK_END) != 0 || (end = ftell(in)) <= 0) return 0;
+  size = end;
 
-  /* Initialize new node's values */
-  newNode->data = data;
-  newNode->frequency = frequency;
-  newNode->left = NULL;
-  newNode->right = NULL;
-  newNode->next = NULL;
+  chunks = size * (percent / 100) / sampleChunk + 1;
+  stride = size / chunks;
 
-  return insertSorted(head, newNode);
+  /* The sample would cover the whole file anyway */
+  if(stride <= sampleChunk)
+  {
+    rewind(in);
+    return countFrequencies(in, lanes);
+  }
+
+  buffer = malloc(sampleChunk);
+  sorted = blockSorting ? malloc(2 * sampleChunk) : NULL;
+  for(k = 0; k < chunks; k++)
+  {
+    fseek(in, (long) (k * stride), SEEK_SET);
+    length = fread(buffer, 1, sampleChunk, in);
+    countSymbols(buffer, length, sorted, frequencyMap);
+  }
+  free(buffer);
+  free(sorted);
+
+  /* Escape path: nothing may be left without a code */
+  for(i = 0; i < 256; i++)
+    frequencyMap[i]++;
+
+  return size;
 }
 
 /*********************************************************************************************
@@ -150,9 +693,9 @@ void printQueue(struct QueueNode* head)
   while(current != NULL)
   {
     if(current->data < 33 || current->data > 126)
-      printf("=%d occurred %d times\n", current->data, current->frequency);
+      printf("=%d occurred %lu times\n", current->data, current->frequency);
 
-    else printf("%c occurred %d times\n", current->data, current->frequency);
+    else printf("%c occurred %lu times\n", current->data, current->frequency);
     current = current->next;
   }
   printf("\n");
@@ -176,53 +719,6 @@ void freeQueue(struct QueueNode* head)
 }
 
 
-/*********************************************************************************
- * struct QueueNode* createNodeTree (struct QueueNode* head)
- *
- * Makes a node that is the root of two or more combined
- * nodes when building the Huffman tree. Takes the first
- * nodes from a sorted list, starting at head. Returns the
- * new head.
- */
-struct QueueNode* createNodeTree (struct QueueNode* head)
-{
-  /* Make space for new node to insert (root node of two combined nodes) */
-  struct QueueNode* newNode = malloc(sizeof(struct QueueNode));
-
-  /* Make the ndoe to be the new head */
-  struct QueueNode* newHead;
-
-  /* Initialize values of the new node, change pointers of children */
-  newNode->data = head->next->data;
-  newNode->frequency = (head->frequency) + (head->next->frequency);
-  newNode->left = head;
-  newNode->right = head->next;
-  newNode->next = NULL;
-
-  newHead = head->next->next;
-  head->next->next = NULL;
-  head->next = NULL;
-
-  /* Insert new root with children back into queue */
-  return insertSorted(newHead, newNode);
-
-}
-
-/****************************************************************
- * struct QueueNode* buildTree(struct QueueNode* head)
- *
- * Calls createNodeTree on a queue at head, which combines two
- * nodes until only one remains and a huffman tree is formed.
- * Returns the tree root.
- */
-struct QueueNode* buildTree(struct QueueNode* head)
-{
-  while(head->next != NULL)
-    head = createNodeTree(head);
-
-  return head;
-}
-
 /***************************************************************************
  * void printTree(struct QueueNode* head)
  *
@@ -237,7 +733,7 @@ void printTree(struct QueueNode* head)
 
     /* If this isn't a leaf/child, incidate so */
     if(head->left != NULL && head->right != NULL)
-      printf("Parent of left:%d%c and right:%d%c; node:%d%c\n",
+      printf("Parent of left:%lu%c and right:%lu%c; node:%lu%c\n",
 	     head->left->frequency, head->left->data,
 	     head->right->frequency, head->right->data,
 	     head->frequency, head->data);
@@ -246,30 +742,15 @@ void printTree(struct QueueNode* head)
     else
     {
       if(head->data < 33 || head->data > 126)
-	printf("=%d occurred %d times\n", head->data, head->frequency);
+	printf("=%d occurred %lu times\n", head->data, head->frequency);
 
-      else printf("%c occurred %d times\n", head->data, head->frequency);
+      else printf("%c occurred %lu times\n", head->data, head->frequency);
     }
 
     printTree(head->right);
   }
 }
 
-/*****************************************************************************
- * void freeTree(struct QueueNode* head)
- *
- * Frees the tree starting at head from memory.
- */
-void freeTree(struct QueueNode* head)
-{
-  if(head != NULL)
-  {
-    freeTree(head->left);
-    freeTree(head->right);
-    free(head);
-  }
-}
-
 /********************************************************
  * void storeCodes(int arr[], int n, int data)
  *
@@ -313,10 +794,10 @@ void printDataValues()
       count++;
 
       /* It's non-printing ASCII */
-      if(i < 33 || i > 126) printf("=%d\t%d\t", i, frequencyMap[i]);
+      if(i < 33 || i > 126) printf("=%d\t%lu\t", i, frequencyMap[i]);
 
       /* It's printing ASCII */
-      else printf("%c\t%d\t", i, frequencyMap[i]);
+      else printf("%c\t%lu\t", i, frequencyMap[i]);
 
       for(j = 1; j < huffmanValues[i][0] + 1; j++)
 	printf("%d", huffmanValues[i][j]);
@@ -368,145 +849,568 @@ void generateCodesHelper(struct QueueNode* root)
   generateCodes(root, arr, top);
 }
 
-/**********************************************************************
-* struct bitNode* createNodeInsert(struct bitNode* head, int data)
-*
-* Creates a bitNode and inserts it at the end of the currently
-* existing bitNodes. Data is the bit value of the node, and head is
-* this head of the bitNode linked list.
-*/
-struct bitNode* createNodeInsert(struct bitNode* head, int data)
+/*********************************************************************
+ * void packCodes()
+ *
+ * Packs each huffman code in huffmanValues into a single word for
+ * the coding stages, first bit of the code in the lowest bit. Codes
+ * too long to pack are left to the bit-by-bit path in encodeBlock.
+ */
+void packCodes()
 {
-  /* Node for iterating */
-  struct bitNode* current = head;
-
-  /* New node to be added, with given values */
-  struct bitNode* node = malloc(sizeof(struct bitNode));
-  node->bit = data;
-  node->nextBit = NULL;
+  int i, j;
 
-  /* Put new node in list */
-  if(head == NULL) return node;
-  else
+  for(i = 0; i < 256; i++)
   {
-    while(current->nextBit != NULL) current = current->nextBit;
-    current->nextBit = node;
-    return head;
+    codeWord[i] = 0;
+    codeLength[i] = huffmanValues[i][0];
+
+    if(codeLength[i] <= maxPackedLength)
+      for(j = 0; j < codeLength[i]; j++)
+	codeWord[i] |= (unsigned long) huffmanValues[i][j + 1] << j;
   }
 }
 
-/**************************************************************
- * int bitAmount(struct bitNode* head)
+/******************************************************************
+ * void encodeBlock(struct Block* block)
  *
- * Helper function that calculates the current amount of
- * bitNodes in existance to see if a byte can be output.
- * head is the head of the bitNode list.
+ * Picks how to store block from its histogram. A block of one
+ * repeated byte becomes a blockSingle run, and one the code table
+ * can't shrink is passed through as blockStored. Anything else is
+ * Huffman coded into the coded buffer, packing bits from the lowest
+ * bit of each byte up and padding the last byte with zeroes. When
+ * block sorting, it's the block-sorted symbols that are coded, as
+ * a blockSorted block.
  */
-int bitAmount(struct bitNode* head)
+void encodeBlock(struct Block* block)
 {
-  struct bitNode* current = head;
-  int count = 0;
+  unsigned char* out = block->coded;
+  unsigned char* symbols = block->data;
+  size_t count = block->length;
+  size_t extra = sizeof(unsigned long);
+  unsigned long acc = 0, bits = 0;
+  int accBits = 0, distinct = 0;
+  size_t i;
+  int c, j;
+
+  block->crc = crc32c(0, block->data, block->length);
+
+  /* The primary row and symbol count are sent as well */
+  if(blockSorting)
+    block->sortedLength = sortSymbols(block->data, block->length, block->sorted, &block->primary);
+  if(blockSorting && block->sortedLength > 0)
+  {
+    symbols = block->sorted;
+    count = block->sortedLength;
+    extra += 2 * sizeof(unsigned long);
+  }
 
-  while(current != NULL)
+  memset(block->histogram, 0, sizeof(block->histogram));
+  for(i = 0; i < count; i++)
+    block->histogram[symbols[i]]++;
+
+  for(c = 0; c < 256; c++)
+    if(block->histogram[c] > 0)
+    {
+      distinct++;
+      bits += block->histogram[c] * codeLength[c];
+    }
+
+  /* Sorted symbols can all be alike when the input isn't */
+  if(distinct == 1 && symbols == block->data)
   {
-    count++;
-    current = current->nextBit;
+    block->mode = blockSingle;
+    return;
   }
-  return count;
+
+  /* Coding wouldn't pay for the extra length fields */
+  if((bits + 7) / 8 + extra >= block->length)
+  {
+    block->mode = blockStored;
+    return;
+  }
+
+  block->mode = symbols == block->data ? blockHuffman : blockSorted;
+
+  for(i = 0; i < count; i++)
+  {
+    c = symbols[i];
+
+    if(codeLength[c] <= maxPackedLength)
+    {
+      acc |= codeWord[c] << accBits;
+      accBits += codeLength[c];
+    }
+
+    /* Very deep trees: feed the code in one bit at a time */
+    else
+      for(j = 1; j < codeLength[c] + 1; j++)
+      {
+	acc |= (unsigned long) huffmanValues[c][j] << accBits;
+	if(++accBits == 8)
+	{
+	  *out++ = acc;
+	  acc = 0;
+	  accBits = 0;
+	}
+      }
+
+    /* Flush whole bytes so the accumulator never overflows */
+    while(accBits >= 8)
+    {
+      *out++ = acc & 0xFF;
+      acc >>= 8;
+      accBits -= 8;
+    }
+  }
+
+  if(accBits) *out++ = acc;
+  block->codedBytes = out - block->coded;
 }
 
-/****************************************************************
- * struct bitNode* outputByte(struct bitNode* head, FILE* out)
+/*****************************************************************
+ * void* readerStage(void* arg)
  *
- * Outputs a byte from the bitNodes starting at head to the
- * output stream, out.
+ * Reader thread. Fills recycled blocks from the input stream and
+ * deals them to the lanes in turn, then marks the end of input on
+ * every lane so all coding stages shut down.
  */
-struct bitNode* outputByte(struct bitNode* head, FILE* out)
+void* readerStage(void* arg)
 {
-  int i, output = 0;
-  struct bitNode* current = head;
+  struct Pipeline* pipe = arg;
+  struct Block* block;
+  unsigned long seq = 0;
+  size_t length;
+  int i;
 
-  /* Build the number from the given bits */
-  for(i = 0; i < 8; i++)
+  for(;;)
   {
-    output += (current->bit) * pow(2, i);
-    current = current->nextBit;
+    struct Lane* lane = &pipe->lanes[seq++ % pipe->laneCount];
+
+    /* Stop at the counted length even if the file has grown since */
+    length = blockSize;
+    if(length > pipe->inputLeft) length = pipe->inputLeft;
+
+    block = ringPop(&lane->toReader);
+    block->length = fread(block->data, 1, length, pipe->in);
+    pipe->inputLeft -= block->length;
+    block->last = block->length == 0;
+    block->seq = seq - 1;
+
+    if(block->last) break;
+    ringPush(&lane->toCoder, block);
   }
 
-  /* Free the used bits, set new head */
-  for(i = 0; i < 8; i++)
+  /* The lane that hit EOF gets its marker first, in sequence order */
+  ringPush(&pipe->lanes[(seq - 1) % pipe->laneCount].toCoder, block);
+  for(i = 1; i < pipe->laneCount; i++)
   {
-    current = head->nextBit;
-    free(head);
-    head = current;
+    struct Lane* lane = &pipe->lanes[(seq - 1 + i) % pipe->laneCount];
+    block = ringPop(&lane->toReader);
+    block->length = 0;
+    block->last = 1;
+    ringPush(&lane->toCoder, block);
   }
 
-  /* Output the byte */
-  fputc(output, out);
-
-  return head;
+  return NULL;
 }
 
 /************************************************************
- * void encode(FILE* in, FILE* out)
+ * void* coderStage(void* arg)
  *
- * Top level function that calls helper functions for
- * encding. While the input steam, in, is not at the end,
- * encodes bytes and puts them to the output stream, out.
+ * Coding thread for one lane. Encodes every block handed to
+ * it and passes it on to the writer, until the end marker.
  */
-void encode(FILE* in, FILE* out)
+void* coderStage(void* arg)
 {
-  int i;
-  int c;
-  struct bitNode* head = NULL;
-
+  struct Lane* lane = arg;
+  struct Block* block;
+  int last;
 
-  /* While not EOF */
-  while(!feof(in))
+  do
   {
-    c = getc(in);
+    block = ringPop(&lane->toCoder);
+    last = block->last;
 
-    /* Add all the huffman values as bits to the list */
-    for(i = 1; i < huffmanValues[c][0] + 1; i++)
+    if(!last)
     {
-      head = createNodeInsert(head, huffmanValues[c][i]);
-    }
+      encodeBlock(block);
 
-    /* If we have enough to make a byte, do so */
-    if(bitAmount(head) > 7)
+      if(lane->countBytes)
       {
-	head = outputByte(head, out);
+	int c;
+
+	/* A block of one repeated byte isn't block-sorted, so its bytes
+	   aren't symbols countFrequencies would have seen */
+	if(!blockSorting || block->mode != blockSingle)
+	  for(c = 0; c < 256; c++)
+	    lane->counted.symbols[c] += block->histogram[c];
+
+	if(block->mode == blockHuffman || block->mode == blockSorted)
+	  for(c = 0; c < 256; c++)
+	    lane->counted.coded[c] += block->histogram[c];
+	else if(block->mode == blockStored)
+	  lane->counted.storedBytes += block->length;
       }
-  }
+    }
 
-  /* If the file ends but a bit isn't full, pad it with zeroes */
+    /* Once pushed, the block may already be back with the reader */
+    ringPush(&lane->toWriter, block);
+  } while(!last);
 
-  if(bitAmount(head) % 8)
-  {
-    while(bitAmount(head) % 8)
-    {
-      createNodeInsert(head, 0);
-    }
-    outputByte(head, out);
-  }
+  return NULL;
 }
 
-/**********************************************************
- * void writeSymbolAndFreq(FILE* out)
+/*****************************************************************
+ * void writeOut(struct Pipeline* pipe, const void* data,
+ *               size_t length)
  *
- * Writes the symbols and their respective frequencies
- * to the output steam, out.
+ * Writes length bytes at data to the pipeline's output, counting
+ * them, and notes it in writeFailed if they didn't all go.
  */
-void writeSymbolAndFreq(FILE* out)
+void writeOut(struct Pipeline* pipe, const void* data, size_t length)
 {
-  int i;
-  unsigned char symbol;
-  unsigned long frequency;
-  unsigned short symbolCount;
+  if(fwrite(data, 1, length, pipe->out) != length) pipe->writeFailed = 1;
+  pipe->writtenBytes += length;
+}
 
-  /* Loop over gathered frequencies to output the
-     total symbols */
-  for(i = 0; i < 256; i++)
+/*****************************************************************
+ * void writerStage(struct Pipeline* pipe)
+ *
+ * Writer, run on the calling thread. Collects coded blocks from
+ * the lanes in the order they were read and writes each out as
+ * its mode, raw length, CRC32C and then, per mode, the coded length
+ * and coded bytes, the raw bytes, or the single repeated byte. A
+ * block-sorted block has its primary row and symbol count before
+ * its coded length. When verifying, written blocks go on to the
+ * lane's verifier. Last of all comes the CRC32C of the blocks'
+ * CRC32Cs.
+ */
+void writerStage(struct Pipeline* pipe)
+{
+  unsigned long seq = 0;
+  struct Block* block;
+  unsigned char mode;
+  unsigned long length, codedBytes, sortedLength;
+
+  for(;;)
+  {
+    struct Lane* lane = &pipe->lanes[seq++ % pipe->laneCount];
+
+    block = ringPop(&lane->toWriter);
+    if(block->last) break;
+
+    mode = block->mode;
+    length = block->length;
+    writeOut(pipe, &mode, sizeof(unsigned char));
+    writeOut(pipe, &length, sizeof(unsigned long));
+    writeOut(pipe, &block->crc, sizeof(unsigned int));
+    pipe->streamCrc = crc32c(pipe->streamCrc, (unsigned char*) &block->crc, sizeof(unsigned int));
+
+    if(mode == blockSorted)
+    {
+      sortedLength = block->sortedLength;
+      writeOut(pipe, &block->primary, sizeof(unsigned long));
+      writeOut(pipe, &sortedLength, sizeof(unsigned long));
+    }
+
+    if(mode == blockHuffman || mode == blockSorted)
+    {
+      codedBytes = block->codedBytes;
+      writeOut(pipe, &codedBytes, sizeof(unsigned long));
+      writeOut(pipe, block->coded, codedBytes);
+    }
+
+    else if(mode == blockStored)
+    {
+      writeOut(pipe, block->data, length);
+    }
+
+    else
+    {
+      writeOut(pipe, block->data, 1);
+    }
+
+    blockCounts[mode]++;
+
+    if(pipe->verifyTree != NULL) ringPush(&lane->toVerifier, block);
+    else ringPush(&lane->toReader, block);
+  }
+
+  writeOut(pipe, &pipe->streamCrc, sizeof(unsigned int));
+
+  /* Every verifier gets an end marker; the other lanes' are the
+     only blocks left with the writer */
+  if(pipe->verifyTree != NULL)
+  {
+    int i;
+
+    ringPush(&pipe->lanes[(seq - 1) % pipe->laneCount].toVerifier, block);
+    for(i = 1; i < pipe->laneCount; i++)
+    {
+      struct Lane* lane = &pipe->lanes[(seq - 1 + i) % pipe->laneCount];
+      ringPush(&lane->toVerifier, ringPop(&lane->toWriter));
+    }
+  }
+}
+
+/******************************************************************
+ * int verifyBlock(struct Block* block, struct QueueNode* root,
+ *                 struct Unsorter* u)
+ *
+ * Decodes block as written, from its coded bytes with the tree at
+ * root for a Huffman block, and checks it gives back the input
+ * still held in the block. A block-sorted block is decoded to the
+ * symbols it was sorted into, then unsorted in u and compared with
+ * the input. Returns 0 if it doesn't match.
+ */
+int verifyBlock(struct Block* block, struct QueueNode* root, struct Unsorter* u)
+{
+  const unsigned char* from = block->coded;
+  const unsigned char* end = block->coded + block->codedBytes;
+  const unsigned char* symbols = block->data;
+  size_t count = block->length;
+  struct QueueNode* node;
+  struct TableEntry* entry;
+  unsigned long bitBuffer = 0;
+  int bits = 0;
+  size_t i;
+
+  /* Written straight from the input */
+  if(block->mode == blockStored) return 1;
+
+  if(block->mode == blockSingle)
+  {
+    for(i = 1; i < block->length; i++)
+      if(block->data[i] != block->data[0]) return 0;
+    return 1;
+  }
+
+  if(root == NULL || root->left == NULL) return 0;
+
+  if(block->mode == blockSorted)
+  {
+    symbols = block->sorted;
+    count = block->sortedLength;
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    node = root;
+
+    do
+    {
+      while(bits <= 24 && from < end)
+      {
+	bitBuffer |= (unsigned long) *from++ << bits;
+	bits += 8;
+      }
+
+      if(node == root && bits >= decodeTableBits)
+      {
+	entry = &decodeTable[bitBuffer & ((1 << decodeTableBits) - 1)];
+	node = entry->node;
+	bitBuffer >>= entry->length;
+	bits -= entry->length;
+      }
+
+      else
+      {
+	if(bits == 0) return 0;
+
+	node = bitBuffer & 1 ? node->right : node->left;
+	bitBuffer >>= 1;
+	bits--;
+      }
+    } while(node->left != NULL);
+
+    if(node->data != symbols[i]) return 0;
+  }
+
+  /* Nothing but padding may be left over */
+  if(from != end || bits >= 8) return 0;
+
+  /* The symbols decode right, so undo the sort on them */
+  if(block->mode == blockSorted)
+    return unsorterFit(u, block->length, 0)
+      && unsort(u, block->sorted, block->sortedLength, block->primary, block->length)
+      && memcmp(u->out, block->data, block->length) == 0;
+
+  return 1;
+}
+
+/************************************************************
+ * void* verifierStage(void* arg)
+ *
+ * Verifying thread for one lane. Checks every block the
+ * writer has written decodes back to its input, recording
+ * any that don't, then recycles it to the reader.
+ */
+void* verifierStage(void* arg)
+{
+  struct Lane* lane = arg;
+  struct Pipeline* pipe = lane->pipe;
+  struct Block* block;
+  unsigned long first;
+
+  while(!(block = ringPop(&lane->toVerifier))->last)
+  {
+    if(!verifyBlock(block, pipe->verifyTree, &lane->unsorter))
+    {
+      __atomic_fetch_add(&pipe->badBlocks, 1, __ATOMIC_RELAXED);
+
+      /* Lanes can fail at once; keep the earliest block */
+      first = __atomic_load_n(&pipe->firstBadBlock, __ATOMIC_RELAXED);
+      while(block->seq < first
+	    && !__atomic_compare_exchange_n(&pipe->firstBadBlock, &first, block->seq, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+    }
+
+    ringPush(&lane->toReader, block);
+  }
+
+  return NULL;
+}
+
+/***************************************************************************
+ * unsigned long encode(FILE* in, unsigned long length, FILE* out,
+ *                      int lanes, struct ExactCount* exact)
+ *
+ * Top level function for encoding. Runs a reader thread, a
+ * coding thread per lane and the writer on this thread, all
+ * joined by rings of recycled blocks, so reading, coding and
+ * writing of the first length bytes of the input stream, in, to
+ * out overlap. If exact is not NULL the coding stages also add
+ * up there what they coded and how. If
+ * verifyTree is set, each block is decoded again as it's written,
+ * adding any that don't match to badBlocks. Returns the number of
+ * bytes written.
+ */
+unsigned long encode(FILE* in, unsigned long length, FILE* out, int lanes, struct ExactCount* exact)
+{
+  struct Pipeline pipe;
+  pthread_t reader;
+  int i, j;
+
+  packCodes();
+
+  pipe.in = in;
+  pipe.out = out;
+  pipe.inputLeft = length;
+  pipe.laneCount = lanes;
+  pipe.lanes = calloc(lanes, sizeof(struct Lane));
+  pipe.writtenBytes = 0;
+  pipe.writeFailed = 0;
+  pipe.streamCrc = 0;
+  pipe.verifyTree = verifyTree;
+  pipe.badBlocks = 0;
+  pipe.firstBadBlock = (unsigned long) -1;
+
+  buildDecodeTable(decodeTable, verifyTree);
+
+  for(i = 0; i < lanes; i++)
+  {
+    pipe.lanes[i].countBytes = exact != NULL;
+    pipe.lanes[i].pipe = &pipe;
+    ringInit(&pipe.lanes[i].toCoder);
+    ringInit(&pipe.lanes[i].toWriter);
+    ringInit(&pipe.lanes[i].toVerifier);
+    ringInit(&pipe.lanes[i].toReader);
+  }
+
+  for(i = 0; i < lanes; i++)
+    for(j = 0; j < ringSize; j++)
+    {
+      pipe.lanes[i].blocks[j].data = malloc(blockSize);
+      pipe.lanes[i].blocks[j].coded = malloc(blockSize);
+      pipe.lanes[i].blocks[j].sorted = blockSorting ? malloc(2 * blockSize) : NULL;
+      ringPush(&pipe.lanes[i].toReader, &pipe.lanes[i].blocks[j]);
+    }
+
+  for(i = 0; i < lanes; i++)
+  {
+    pthread_create(&pipe.lanes[i].thread, NULL, coderStage, &pipe.lanes[i]);
+    if(verifyTree != NULL)
+      pthread_create(&pipe.lanes[i].verifier, NULL, verifierStage, &pipe.lanes[i]);
+  }
+  pthread_create(&reader, NULL, readerStage, &pipe);
+
+  writerStage(&pipe);
+
+  pthread_join(reader, NULL);
+  for(i = 0; i < lanes; i++)
+  {
+    pthread_join(pipe.lanes[i].thread, NULL);
+    if(verifyTree != NULL) pthread_join(pipe.lanes[i].verifier, NULL);
+  }
+
+  if(pipe.writeFailed) writeFailed = 1;
+
+  /* Report the first bad block of the first encode to fail */
+  if(pipe.badBlocks > 0 && badBlocks == 0) firstBadBlock = pipe.firstBadBlock;
+  badBlocks += pipe.badBlocks;
+
+  if(exact != NULL)
+    for(i = 0; i < lanes; i++)
+    {
+      for(j = 0; j < 256; j++)
+      {
+	exact->symbols[j] += pipe.lanes[i].counted.symbols[j];
+	exact->coded[j] += pipe.lanes[i].counted.coded[j];
+      }
+      exact->storedBytes += pipe.lanes[i].counted.storedBytes;
+    }
+
+  /* Clean up. */
+  for(i = 0; i < lanes; i++)
+    for(j = 0; j < ringSize; j++)
+    {
+      free(pipe.lanes[i].blocks[j].data);
+      free(pipe.lanes[i].blocks[j].coded);
+      free(pipe.lanes[i].blocks[j].sorted);
+    }
+  for(i = 0; i < lanes; i++)
+  {
+    unsorterFree(&pipe.lanes[i].unsorter);
+    ringFree(&pipe.lanes[i].toCoder);
+    ringFree(&pipe.lanes[i].toWriter);
+    ringFree(&pipe.lanes[i].toVerifier);
+    ringFree(&pipe.lanes[i].toReader);
+  }
+  free(pipe.lanes);
+
+  return pipe.writtenBytes;
+}
+
+/**********************************************************
+ * void writeMagic(FILE* out, char* magic)
+ *
+ * Writes magic, frameMagic or archiveMagic, and then the
+ * format version, which is higher when block sorting.
+ */
+void writeMagic(FILE* out, char* magic)
+{
+  fwrite(magic, 1, frameMagicLength - 1, out);
+  fputc(blockSorting ? sortedFormatVersion : formatVersion, out);
+}
+
+/**********************************************************
+ * void writeSymbolAndFreq(FILE* out)
+ *
+ * Writes the symbols and their respective frequencies
+ * to the output steam, out.
+ */
+void writeSymbolAndFreq(FILE* out)
+{
+  int i;
+  unsigned char symbol;
+  unsigned long frequency;
+  unsigned short symbolCount = 0;
+
+  /* Loop over gathered frequencies to output the
+     total symbols */
+  for(i = 0; i < 256; i++)
     if(frequencyMap[i] > 0) symbolCount++;
 
   fwrite(&symbolCount, sizeof(unsigned short), 1, out);
@@ -525,6 +1429,322 @@ void writeSymbolAndFreq(FILE* out)
   }
 }
 
+/**********************************************************************
+ * void listFiles(char* path, struct FileList* list)
+ *
+ * Adds path to list if it's a regular file, or every regular file
+ * under it if it's a directory. Symbolic links aren't followed. A
+ * path that can't be looked at is added so it's reported later.
+ */
+void listFiles(char* path, struct FileList* list)
+{
+  struct stat info;
+  struct dirent* entry;
+  DIR* dir;
+  char* child;
+
+  if(lstat(path, &info) != 0 || S_ISREG(info.st_mode))
+  {
+    if(list->count == list->capacity)
+    {
+      list->capacity = list->capacity ? list->capacity * 2 : 64;
+      list->paths = realloc(list->paths, list->capacity * sizeof(char*));
+    }
+
+    list->paths[list->count] = malloc(strlen(path) + 1);
+    strcpy(list->paths[list->count++], path);
+  }
+
+  else if(S_ISDIR(info.st_mode) && (dir = opendir(path)) != NULL)
+  {
+    while((entry = readdir(dir)) != NULL)
+    {
+      if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+	continue;
+
+      child = malloc(strlen(path) + strlen(entry->d_name) + 2);
+      sprintf(child, "%s/%s", path, entry->d_name);
+      listFiles(child, list);
+      free(child);
+    }
+    closedir(dir);
+  }
+}
+
+/*****************************************************************
+ * void* analyzeWorker(void* arg)
+ *
+ * Dry run worker thread. Takes the next unclaimed file off the
+ * shared list and analyzes it, until none are left.
+ */
+void* analyzeWorker(void* arg)
+{
+  struct FileList* list = arg;
+  unsigned long next;
+  FILE* in;
+
+  while((next = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED)) < list->count)
+  {
+    in = fopen(list->paths[next], "rb");
+    list->results[next].error = in == NULL
+      || !analyzeStream(in, list->samplePercent, blockSize, maxCodeLength,
+			&list->results[next]);
+    if(in != NULL) fclose(in);
+  }
+
+  return NULL;
+}
+
+/*****************************************************************
+ * int dryRun(char** paths, int pathCount, int workers,
+ *            double samplePercent)
+ *
+ * Analyzes every file named in paths, walking into directories,
+ * on workers threads, and prints what encoding each would give,
+ * with the table sampled from samplePercent of it if that isn't
+ * 0, along with the totals. Nothing is written. Returns the number
+ * of files that couldn't be read.
+ */
+int dryRun(char** paths, int pathCount, int workers, double samplePercent)
+{
+  struct FileList list;
+  pthread_t threads[maxLanes];
+  unsigned long totalIn = 0, totalOut = 0, i;
+  int failed = 0;
+
+  memset(&list, 0, sizeof(struct FileList));
+  list.samplePercent = samplePercent;
+  for(i = 0; i < (unsigned long) pathCount; i++)
+    listFiles(paths[i], &list);
+
+  list.results = calloc(list.count + 1, sizeof(struct Analysis));
+
+  for(i = 0; i < (unsigned long) workers; i++)
+    pthread_create(&threads[i], NULL, analyzeWorker, &list);
+  for(i = 0; i < (unsigned long) workers; i++)
+    pthread_join(threads[i], NULL);
+
+  printf("Input\tEncoded\tRatio\tEntropy\tFile\n");
+  for(i = 0; i < list.count; i++)
+  {
+    struct Analysis* result = &list.results[i];
+
+    if(result->error)
+    {
+      printf("couldn't read %s\n", list.paths[i]);
+      failed++;
+    }
+
+    else
+    {
+      printf("%lu\t%lu\t%.3f\t%.3f\t%s\n", result->inputBytes, result->estimatedBytes,
+	     result->inputBytes ? (double) result->estimatedBytes / result->inputBytes : 0.0,
+	     result->entropy, list.paths[i]);
+      totalIn += result->inputBytes;
+      totalOut += result->estimatedBytes;
+    }
+
+    free(list.paths[i]);
+  }
+
+  printf("%lu\t%lu\t%.3f\t\ttotal of %lu files\n", totalIn, totalOut,
+	 totalIn ? (double) totalOut / totalIn : 0.0, list.count - failed);
+
+  free(list.paths);
+  free(list.results);
+  return failed;
+}
+
+/*****************************************************************
+ * int closeOutput(FILE* out)
+ *
+ * Flushes and closes out. Returns 0 if that or any write to it,
+ * the coded blocks' or the headers', failed, so the output is
+ * missing or incomplete.
+ */
+int closeOutput(FILE* out)
+{
+  int ok = !writeFailed && fflush(out) == 0 && !ferror(out);
+
+  return fclose(out) == 0 && ok;
+}
+
+/*****************************************************************
+ * int writeArchive(char* name, char** paths, int pathCount, int lanes,
+ *                  int verify, double samplePercent)
+ *
+ * Encodes every file named in paths, walking into directories, into
+ * one archive called name. The files share a single code table built
+ * from all of them, sampled from samplePercent of each if that isn't
+ * 0, and each is stored as its own run of blocks. A
+ * central directory of names, offsets and sizes at the end, found
+ * through a fixed size trailer, lets any one file be extracted on its
+ * own. With verify set, each file's blocks are decoded again as
+ * they're written. Returns the exit code for main: 6 if the archive
+ * couldn't be written in full, else 5 if a file didn't verify, else
+ * 2 if a file couldn't be read, else 0.
+ */
+int writeArchive(char* name, char** paths, int pathCount, int lanes, int verify,
+		 double samplePercent)
+{
+  struct FileList list;
+  struct QueueNode* head = NULL;
+  unsigned long* offsets;
+  unsigned long* sizes;
+  unsigned long* codedSizes;
+  unsigned long dirOffset, members = 0, i, bad;
+  unsigned short nameLength;
+  int failed = 0, unverified = 0, c;
+  FILE* in;
+  FILE* out;
+
+  memset(&list, 0, sizeof(struct FileList));
+  for(i = 0; i < (unsigned long) pathCount; i++)
+    listFiles(paths[i], &list);
+
+  offsets = calloc(list.count + 1, sizeof(unsigned long));
+  sizes = calloc(list.count + 1, sizeof(unsigned long));
+  codedSizes = calloc(list.count + 1, sizeof(unsigned long));
+
+  /* One table counted over every file */
+  for(i = 0; i < list.count; i++)
+  {
+    in = fopen(list.paths[i], "rb");
+    if(in == NULL)
+    {
+      printf("couldn't open %s for reading\n", list.paths[i]);
+      free(list.paths[i]);
+      list.paths[i] = NULL;
+      failed++;
+      continue;
+    }
+
+    /* A file that can't be sampled is counted whole */
+    sizes[i] = samplePercent > 0 ? sampleFrequencies(in, samplePercent, lanes) : 0;
+    if(sizes[i] == 0)
+    {
+      rewind(in);
+      sizes[i] = countFrequencies(in, lanes);
+    }
+    fclose(in);
+  }
+
+  if(maxCodeLength < maxHeight) limitCodeLengths(frequencyMap, maxCodeLength);
+
+  for(c = 0; c < 256; c++)
+    if(frequencyMap[c] > 0)
+      head = createNodeLinked(head, c, frequencyMap[c]);
+
+  if(head != NULL)
+  {
+    head = buildTree(head);
+    generateCodesHelper(head);
+  }
+
+  if(verify) verifyTree = head;
+
+  out = fopen(name, "wb");
+  if(out == NULL)
+  {
+    printf("couldn't open %s for writing\n", name);
+    exit(3);
+  }
+
+  writeMagic(out, archiveMagic);
+  writeSymbolAndFreq(out);
+
+  /* Each file's blocks, back to back */
+  for(i = 0; i < list.count; i++)
+  {
+    if(list.paths[i] == NULL) continue;
+
+    in = fopen(list.paths[i], "rb");
+    if(in == NULL)
+    {
+      printf("couldn't open %s for reading\n", list.paths[i]);
+      free(list.paths[i]);
+      list.paths[i] = NULL;
+      failed++;
+      continue;
+    }
+
+    offsets[i] = ftell(out);
+    bad = badBlocks;
+    codedSizes[i] = encode(in, sizes[i], out, lanes, NULL);
+    fclose(in);
+
+    if(badBlocks > bad)
+    {
+      printf("%s didn't verify\n", list.paths[i]);
+      unverified++;
+    }
+  }
+
+  /* Central directory, then the trailer pointing at it */
+  dirOffset = ftell(out);
+  for(i = 0; i < list.count; i++)
+  {
+    if(list.paths[i] == NULL) continue;
+
+    nameLength = strlen(list.paths[i]);
+    fwrite(&nameLength, sizeof(unsigned short), 1, out);
+    fwrite(list.paths[i], 1, nameLength, out);
+    fwrite(&offsets[i], sizeof(unsigned long), 1, out);
+    fwrite(&sizes[i], sizeof(unsigned long), 1, out);
+    fwrite(&codedSizes[i], sizeof(unsigned long), 1, out);
+
+    printf("%lu\t%lu\t%s\n", sizes[i], codedSizes[i], list.paths[i]);
+    members++;
+    free(list.paths[i]);
+  }
+
+  fwrite(&dirOffset, sizeof(unsigned long), 1, out);
+  fwrite(&members, sizeof(unsigned long), 1, out);
+  writeMagic(out, archiveMagic);
+
+  printf("%lu files, %ld bytes\n", members, ftell(out));
+
+  /* Clean up. */
+  freeTree(head);
+  free(list.paths);
+  free(offsets);
+  free(sizes);
+  free(codedSizes);
+
+  if(!closeOutput(out))
+  {
+    printf("couldn't write all of %s\n", name);
+    return 6;
+  }
+
+  if(unverified) return 5;
+  return failed ? 2 : 0;
+}
+
+/*****************************************************************
+ * int canAppend(char* name)
+ *
+ * Checks the file called name can have frames appended to it:
+ * it either doesn't exist yet, is empty, or starts with a frame of
+ * any format version, since each frame gives its own. Only the
+ * first few bytes are read.
+ */
+int canAppend(char* name)
+{
+  char magic[frameMagicLength];
+  size_t length;
+  FILE* file = fopen(name, "rb");
+
+  if(file == NULL) return 1;
+
+  length = fread(magic, 1, frameMagicLength, file);
+  fclose(file);
+
+  return length == 0
+    || (length == frameMagicLength && memcmp(magic, frameMagic, frameMagicLength - 1) == 0
+	&& magic[frameMagicLength - 1] >= 1 && magic[frameMagicLength - 1] <= sortedFormatVersion);
+}
+
 int main(int argc, char** argv)
 {
   char* infile;
@@ -535,6 +1755,130 @@ int main(int argc, char** argv)
   int i;
   struct QueueNode* head = NULL;
   unsigned long encodedCount;
+  int lanes = 1;
+  double samplePercent = 0;
+  struct ExactCount exactCount;
+  unsigned long writtenBytes, headerBytes;
+  int append = 0, analyze = 0, archive = 0, shift;
+  int level = defaultLevel, sampleGiven = 0, stats = 0, verify = 0;
+
+  crcInit();
+  memset(&exactCount, 0, sizeof(struct ExactCount));
+
+  /* Options come before the file names */
+  while(argc > 2 && argv[1][0] == '-')
+  {
+    shift = 2;
+
+    /* "--append" adds a frame to the end of the output file */
+    if(strcmp(argv[1], "--append") == 0)
+    {
+      append = 1;
+      shift = 1;
+    }
+
+    /* "-1" to "-9" pick a compression level */
+    else if(argv[1][1] >= '1' && argv[1][1] <= '9' && argv[1][2] == '\0')
+    {
+      level = argv[1][1] - '0';
+      shift = 1;
+    }
+
+    /* "--verify" decodes every block again as it's written */
+    else if(strcmp(argv[1], "--verify") == 0)
+    {
+      verify = 1;
+      shift = 1;
+    }
+
+    /* "--stats" reports the settings used and the sizes achieved */
+    else if(strcmp(argv[1], "--stats") == 0)
+    {
+      stats = 1;
+      shift = 1;
+    }
+
+    /* "--archive" packs many files into one, sharing a table */
+    else if(strcmp(argv[1], "--archive") == 0)
+    {
+      archive = 1;
+      shift = 1;
+    }
+
+    /* "--bwt" block-sorts every block before coding it */
+    else if(strcmp(argv[1], "--bwt") == 0)
+    {
+      blockSorting = 1;
+      shift = 1;
+    }
+
+    /* "--dry-run" only reports what encoding would give */
+    else if(strcmp(argv[1], "--dry-run") == 0)
+    {
+      analyze = 1;
+      shift = 1;
+    }
+
+    /* "-t N" picks how many coding stages to run */
+    else if(strcmp(argv[1], "-t") == 0)
+    {
+      lanes = atoi(argv[2]);
+      if(lanes < 1 || lanes > maxLanes)
+      {
+	printf("thread count must be 1 to %d\n", maxLanes);
+	return 1;
+      }
+    }
+
+    /* "-s P" builds the table from a P percent sample of the input */
+    else if(strcmp(argv[1], "-s") == 0)
+    {
+      samplePercent = atof(argv[2]);
+      sampleGiven = 1;
+      if(samplePercent <= 0 || samplePercent > 100)
+      {
+	printf("sample percent must be above 0 and at most 100\n");
+	return 1;
+      }
+    }
+
+    else
+    {
+      printf("unknown option %s\n", argv[1]);
+      return 1;
+    }
+
+    argv += shift;
+    argc -= shift;
+  }
+
+  /* The level picks whatever wasn't given on its own */
+  blockSize = levels[level].blockSize;
+  maxCodeLength = levels[level].maxCodeLength;
+  if(!sampleGiven) samplePercent = levels[level].samplePercent;
+  if(levels[level].blockSorting) blockSorting = 1;
+  if(blockSorting) blockSize = sortedBlockSize;
+
+  /* Counting everything would block-sort the input twice, which
+     only -9 or "-s" asks for */
+  if(blockSorting && !sampleGiven && samplePercent == 0 && !levels[level].blockSorting)
+    samplePercent = sortedSamplePercent;
+
+  /* A dry run takes any number of files and directories, with
+     "-t N" analyzing N at once. */
+  if(analyze && blockSorting)
+  {
+    printf("--dry-run can't estimate --bwt or levels -7 to -9\n");
+    return 1;
+  }
+
+  if(analyze)
+    return dryRun(argv + 1, argc - 1, lanes, samplePercent) ? 2 : 0;
+
+  /* An archive is named first, then the files and directories
+     going into it. */
+  if(archive)
+    return writeArchive(argv[1], argv + 2, argc - 2, lanes, verify, samplePercent);
 
   /* Check for valid amount of args */
   if(argc != 3)
@@ -554,16 +1898,42 @@ int main(int argc, char** argv)
     return 2;
   }
 
-  /* Open output file, check for errors */
-  out = fopen(outfile, "wb");
+  /* Open output file, check for errors. Appending leaves the
+     frames already there alone. */
+  if(append && !canAppend(outfile))
+  {
+    printf("%s isn't an encoded file, can't append to it\n", outfile);
+    return 3;
+  }
+
+  out = fopen(outfile, append ? "ab" : "wb");
   if(out == NULL)
   {
-    printf("couldn't open %s for reading\n", outfile);
+    printf("couldn't open %s for writing\n", outfile);
     return 3;
   }
+  fseek(out, 0, SEEK_END);
+  headerBytes = ftell(out);
+
+  /* Count the frequencies of characters in the in file, from a
+     sample of it if asked and the file can be seeked. */
+  encodedCount = 0;
+  if(samplePercent > 0)
+  {
+    encodedCount = sampleFrequencies(in, samplePercent, lanes);
+    if(encodedCount == 0)
+    {
+      printf("%s can't be sampled, counting all of it\n", infile);
+      samplePercent = 0;
+      rewind(in);
+    }
+  }
+
+  if(samplePercent == 0)
+    encodedCount = countFrequencies(in, lanes);
 
-  /* Count the frequencies of characters in the in file. */
-  countFrequencies(in);
+  /* Keep codes within the level's limit */
+  if(maxCodeLength < maxHeight) limitCodeLengths(frequencyMap, maxCodeLength);
 
   /* Go to top of input file for encoding. */
   rewind(in);
@@ -573,30 +1943,106 @@ int main(int argc, char** argv)
     if(frequencyMap[i] > 0)
       head = createNodeLinked(head, i, frequencyMap[i]);
 
-  /* Build huffman tree. */
-  head = buildTree(head);
+  /* Build huffman tree. An empty input has none. */
+  if(head != NULL) head = buildTree(head);
+
+  /* Start the frame. */
+  writeMagic(out, frameMagic);
 
   /* Write symbols and frequencies, encoded, to file. */
   writeSymbolAndFreq(out);
 
   /* Write total amount of symbols to file. */
-  encodedCount = head->frequency;
   fwrite(&encodedCount, sizeof(unsigned long), 1, out);
+  headerBytes = ftell(out) - headerBytes;
 
   /* Generate the huffman codes for each symbol. */
-  generateCodesHelper(head);
+  if(head != NULL) generateCodesHelper(head);
+
+  /* Check the output as it goes, if asked. */
+  if(verify) verifyTree = head;
 
   /* Print the symbol/frequency/code chart to stdout. */
   printDataValues();
-  printf("Total chars = %d\n", head->frequency);
+  printf("Total chars = %lu\n", encodedCount);
 
   /* Encode the input file. */
-  encode(in, out);
+  writtenBytes = encode(in, encodedCount, out, lanes, samplePercent > 0 ? &exactCount : NULL);
+  printf("Blocks: %lu huffman, %lu stored, %lu single-symbol",
+	 blockCounts[blockHuffman], blockCounts[blockStored], blockCounts[blockSingle]);
+  if(blockSorting) printf(", %lu block-sorted", blockCounts[blockSorted]);
+  printf("\n");
+
+  /* Compare against the table the whole file would have given */
+  if(samplePercent > 0)
+  {
+    struct QueueNode* exact = NULL;
+    unsigned long sampledBytes, exactBytes;
+    int exactSymbols = 0;
+
+    for(i = 0; i < 256; i++)
+      if(exactCount.symbols[i] > 0)
+      {
+	exact = createNodeLinked(exact, i, exactCount.symbols[i]);
+	exactSymbols++;
+      }
+
+    /* The exact size is estimated with each block stored, run or
+       Huffman coded the way it was written */
+    sampledBytes = headerBytes + writtenBytes;
+    exactBytes = frameMagicLength + 2 + exactSymbols * (1 + sizeof(unsigned long))
+      + sizeof(unsigned long) + sizeof(unsigned int);
+    exactBytes += (blockCounts[blockHuffman] + blockCounts[blockStored] + blockCounts[blockSingle]
+		   + blockCounts[blockSorted])
+      * (sizeof(unsigned char) + sizeof(unsigned long) + sizeof(unsigned int));
+    exactBytes += (blockCounts[blockHuffman] + 3 * blockCounts[blockSorted]) * sizeof(unsigned long);
+    exactBytes += exactCount.storedBytes + blockCounts[blockSingle];
+    if(exact != NULL)
+    {
+      exact = buildTree(exact);
+      exactBytes += (treeCost(exact, exactCount.coded, 0) + 7) / 8;
+      freeTree(exact);
+    }
+
+    printf("Sampled %g%% of input: %lu bytes, exact table would give %lu bytes (%+.2f%%)\n",
+	   samplePercent, sampledBytes, exactBytes,
+	   exactBytes ? 100.0 * ((double) sampledBytes - exactBytes) / exactBytes : 0.0);
+  }
+
+  /* Verifying means nothing if the output didn't all get written */
+  if(!closeOutput(out))
+  {
+    printf("couldn't write all of %s\n", outfile);
+    freeTree(head);
+    fclose(in);
+    return 6;
+  }
+
+  if(badBlocks > 0)
+  {
+    printf("%lu blocks didn't verify, the first being block %lu (input offset %lu)\n",
+	   badBlocks, firstBadBlock, firstBadBlock * (unsigned long) blockSize);
+    freeTree(head);
+    fclose(in);
+    return 5;
+  }
+
+  if(stats)
+  {
+    printf("Level %d: %lu byte blocks, ", level, (unsigned long) blockSize);
+    if(blockSorting) printf("block-sorted, ");
+    if(samplePercent > 0) printf("table from a %g%% sample, ", samplePercent);
+    else printf("exact table, ");
+    printf("codes up to %d bits (longest %d), decode table %d bits\n",
+	   maxCodeLength, head != NULL ? treeDepth(head) : 0, decodeTableBits);
+    printf("Input %lu bytes, output %lu bytes (%.2f%%)\n", encodedCount,
+	   headerBytes + writtenBytes,
+	   encodedCount ? 100.0 * (headerBytes + writtenBytes) / encodedCount : 0.0);
+  }
 
   /* Clean up. */
   freeTree(head);
   fclose(in);
-  fclose(out);
 
   return 0;
 }